@@ -0,0 +1,790 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmark of ktail against coreutils tail. It generates a synthetic log and
+ * measures the tail of it at several -n values as well as the throughput of -f
+ * while a writer process appends at fixed rates. Every result is printed as one
+ * JSON object per line.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <sys/ptrace.h>
+#endif
+
+#include "utils.h"
+
+#define BENCH_BUF_SIZE   (1024 * 1024)
+#define BENCH_MAX_RUNS   64
+#define BENCH_TIMEOUT_MS 10000
+#define BENCH_START      "start\n"
+
+struct bench_opts {
+    const char *ktail;
+    const char *tail;
+    const char *dir;
+    unsigned long long size;
+    size_t min_line, max_line;
+    unsigned long outliers;     /* per million lines */
+    size_t outlier_len;
+    const char *lines;
+    unsigned long runs;
+    const char *rates;
+    unsigned long follow_secs;
+    unsigned long long follow_bytes;
+    uint64_t seed;
+    int keep;
+};
+
+static struct bench_opts opts = {
+    .tail = "tail",
+    .dir = "/tmp",
+    .size = 256ULL * 1024 * 1024,
+    .min_line = 20,
+    .max_line = 200,
+    .outliers = 10,
+    .outlier_len = 1024 * 1024,
+    .lines = "10,1000,100000,+1",
+    .runs = 5,
+    .rates = "0,100000",
+    .follow_secs = 2,
+    .follow_bytes = 64ULL * 1024 * 1024,
+    .seed = 42,
+};
+
+struct bench_run {
+    double wall;                /* seconds */
+    struct rusage ru;
+};
+
+static struct option long_options[] = {
+    { "ktail"       , required_argument, NULL, 'k' },
+    { "tail"        , required_argument, NULL, 't' },
+    { "dir"         , required_argument, NULL, 'd' },
+    { "size"        , required_argument, NULL, 's' },
+    { "min-line"    , required_argument, NULL, 'm' },
+    { "max-line"    , required_argument, NULL, 'M' },
+    { "outliers"    , required_argument, NULL, 'o' },
+    { "outlier-len" , required_argument, NULL, 'O' },
+    { "lines"       , required_argument, NULL, 'n' },
+    { "runs"        , required_argument, NULL, 'r' },
+    { "rates"       , required_argument, NULL, 'R' },
+    { "follow-secs" , required_argument, NULL, 'S' },
+    { "follow-bytes", required_argument, NULL, 'B' },
+    { "seed"        , required_argument, NULL, 'x' },
+    { "keep"        , no_argument      , NULL, 'K' },
+    { "help"        , no_argument      , NULL, 'h' },
+    { NULL          , 0                , NULL,  0  }
+};
+
+__attribute__((noreturn)) static void print_usage_and_die(int ret)
+{
+    fprintf(stderr, "ktail_bench [options]\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  --ktail <path>: ktail binary (default: next to ktail_bench)\n");
+    fprintf(stderr, "  --tail <path>: tail to compare with, empty to skip (default: tail)\n");
+    fprintf(stderr, "  --dir <dir>: directory of the generated logs (default: /tmp)\n");
+    fprintf(stderr, "  --size <bytes>[K|M|G]: size of the log (default: 256M)\n");
+    fprintf(stderr, "  --min-line <bytes>: shortest line (default: 20)\n");
+    fprintf(stderr, "  --max-line <bytes>: longest regular line (default: 200)\n");
+    fprintf(stderr, "  --outliers <n>: long lines per million lines (default: 10)\n");
+    fprintf(stderr, "  --outlier-len <bytes>[K|M|G]: length of long lines (default: 1M)\n");
+    fprintf(stderr, "  --lines <list>: -n values, comma separated (default: 10,1000,100000,+1)\n");
+    fprintf(stderr, "  --runs <n>: timed runs per measurement (default: 5)\n");
+    fprintf(stderr, "  --rates <list>: lines per second for -f, 0 is unlimited (default: 0,100000)\n");
+    fprintf(stderr, "  --follow-secs <s>: duration of rate limited -f runs (default: 2)\n");
+    fprintf(stderr, "  --follow-bytes <bytes>[K|M|G]: data of unlimited -f runs (default: 64M)\n");
+    fprintf(stderr, "  --seed <n>: seed of the generated data (default: 42)\n");
+    fprintf(stderr, "  --keep: keep the generated logs\n");
+
+    ret ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
+}
+
+/* <n>[K|M|G] */
+static int bench_size(const char *str, unsigned long long *res)
+{
+    char *end;
+
+    errno = 0;
+    *res = strtoull(str, &end, 10);
+    if (errno || end == str || *str == '-')
+        return -EINVAL;
+
+    switch (*end) {
+    case 'G':
+        *res *= 1024;
+        /* fall through */
+    case 'M':
+        *res *= 1024;
+        /* fall through */
+    case 'K':
+        *res *= 1024;
+        end++;
+        break;
+    }
+
+    return *end ? -EINVAL : 0;
+}
+
+static unsigned long bench_ulong(const char *str, const char *name)
+{
+    long res;
+
+    if (kstrtol(str, 10, &res) || res < 0)
+        err("Invalid argument for --%s", name);
+
+    return res;
+}
+
+/* xorshift64*, the data only has to be reproducible */
+static uint64_t bench_random(void)
+{
+    opts.seed ^= opts.seed >> 12;
+    opts.seed ^= opts.seed << 25;
+    opts.seed ^= opts.seed >> 27;
+
+    return opts.seed * 2685821657736338717ULL;
+}
+
+static double bench_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* fills buf with one line of len bytes, including the newline */
+static void bench_line(char *buf, size_t len, unsigned long long nr)
+{
+    int prefix = snprintf(buf, len, "%llu ", nr);
+
+    for (size_t i = prefix < (int)len ? prefix : len - 1; i + 1 < len; ++i)
+        buf[i] = 'a' + (i * 7 + nr) % 26;
+    buf[len - 1] = '\n';
+}
+
+static size_t bench_line_len(void)
+{
+    if (opts.outliers && bench_random() % 1000000 < opts.outliers)
+        return opts.outlier_len;
+
+    return opts.min_line + bench_random() % (opts.max_line - opts.min_line + 1);
+}
+
+static int bench_write(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        ssize_t rc = write(fd, buf, len);
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        buf += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static void bench_generate(const char *file)
+{
+    size_t max = opts.outlier_len > opts.max_line ? opts.outlier_len : opts.max_line;
+    char *buf = kmalloc(BENCH_BUF_SIZE), *line = kmalloc(max + 1);
+    unsigned long long written = 0, nr = 0;
+    size_t used = 0;
+    int fd;
+
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        err_errno("Failed to create '%s'", file);
+
+    while (written < opts.size) {
+        size_t len = bench_line_len();
+
+        if (len > opts.size - written)
+            len = opts.size - written;
+        bench_line(line, len, nr++);
+
+        if (used + len > BENCH_BUF_SIZE) {
+            if (bench_write(fd, buf, used))
+                err_errno("Failed to write '%s'", file);
+            used = 0;
+        }
+        if (len > BENCH_BUF_SIZE) {
+            if (bench_write(fd, line, len))
+                err_errno("Failed to write '%s'", file);
+        } else {
+            memcpy(buf + used, line, len);
+            used += len;
+        }
+        written += len;
+    }
+
+    if (bench_write(fd, buf, used) || close(fd))
+        err_errno("Failed to write '%s'", file);
+
+    kfree(buf);
+    kfree(line);
+}
+
+static pid_t bench_spawn(char *const argv[], int out_fd, int trace)
+{
+    pid_t pid = fork();
+
+    if (pid < 0)
+        err_errno("fork() failed");
+    if (pid)
+        return pid;
+
+    if (dup2(out_fd, STDOUT_FILENO) < 0)
+        _exit(127);
+#ifdef __linux__
+    if (trace && ptrace(PTRACE_TRACEME, 0, NULL, NULL))
+        _exit(127);
+#else
+    (void)trace;
+#endif
+    execvp(argv[0], argv);
+    _exit(127);
+}
+
+/*
+ * Peak rss of a running process in KiB, or -1. Unlike ru_maxrss it doesn't
+ * include the memory of the benchmark, which the child had before exec.
+ */
+static long bench_hwm(pid_t pid)
+{
+#ifdef __linux__
+    char path[64], line[256];
+    long hwm = -1;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+        if (sscanf(line, "VmHWM: %ld kB", &hwm) == 1)
+            break;
+    fclose(fp);
+
+    return hwm;
+#else
+    (void)pid;
+
+    return -1;
+#endif
+}
+
+static int bench_run(char *const argv[], int out_fd, struct bench_run *run)
+{
+    double start = bench_now();
+    pid_t pid = bench_spawn(argv, out_fd, 0);
+    int status;
+
+    if (wait4(pid, &status, 0, &run->ru) < 0)
+        err_errno("wait4() failed");
+    run->wall = bench_now() - start;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+        print_err("'%s' failed", argv[0]);
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Counts the syscalls of all threads by stopping at each entry and exit. The
+ * peak rss is taken right before the exit. Returns -1 if tracing isn't
+ * possible.
+ */
+static long bench_syscalls(char *const argv[], int out_fd, long *hwm)
+{
+#ifdef __linux__
+    unsigned long stops = 0;
+    pid_t pid = bench_spawn(argv, out_fd, 1), w;
+    int status;
+
+    /* the child stops at exec */
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status))
+        return -1;
+    if (ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD |
+               PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXIT |
+               PTRACE_O_EXITKILL) ||
+        ptrace(PTRACE_SYSCALL, pid, NULL, NULL)) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+
+    while ((w = waitpid(-1, &status, __WALL)) > 0) {
+        int sig;
+
+        if (!WIFSTOPPED(status))
+            continue;
+
+        /* clone events and new threads are no signals for the tracee */
+        sig = WSTOPSIG(status);
+        if (w == pid && status >> 8 == (SIGTRAP | PTRACE_EVENT_EXIT << 8))
+            *hwm = bench_hwm(pid);
+        if (sig == (SIGTRAP | 0x80))
+            stops++;
+        if (sig == (SIGTRAP | 0x80) || sig == SIGTRAP || sig == SIGSTOP)
+            sig = 0;
+        ptrace(PTRACE_SYSCALL, w, NULL, sig);
+    }
+
+    /* exit_group() doesn't return */
+    return (stops + 1) / 2;
+#else
+    (void)argv;
+    (void)out_fd;
+    (void)hwm;
+
+    return -1;
+#endif
+}
+
+/* FNV-1a of a file, to compare the outputs */
+static uint64_t bench_hash(int fd)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    char *buf = kmalloc(BENCH_BUF_SIZE);
+    ssize_t rc;
+
+    lseek(fd, 0, SEEK_SET);
+    while ((rc = read(fd, buf, BENCH_BUF_SIZE)) > 0)
+        for (ssize_t i = 0; i < rc; ++i)
+            hash = (hash ^ (unsigned char)buf[i]) * 1099511628211ULL;
+    kfree(buf);
+
+    return hash;
+}
+
+static int bench_cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_print_tool(const char *bench, const char *tool)
+{
+    printf("{\"bench\":\"%s\",\"tool\":\"%s\"", bench, tool);
+}
+
+static void bench_print_syscalls(long syscalls)
+{
+    if (syscalls < 0)
+        printf(",\"syscalls\":null");
+    else
+        printf(",\"syscalls\":%ld", syscalls);
+}
+
+/*
+ * One warm up run into a temporary file gives the output and its hash. It's
+ * followed by the timed runs into /dev/null and one traced run.
+ */
+static int bench_read(const char *tool, const char *bin, const char *file,
+                      const char *lines, uint64_t *hash, const uint64_t *ref)
+{
+    char *argv[] = { (char *)bin, "-n", (char *)lines, (char *)file, NULL };
+    double walls[BENCH_MAX_RUNS], wall;
+    char out[PATH_MAX];
+    long max_rss = 0, hwm = -1, syscalls;
+    struct bench_run run;
+    struct stat sb;
+    int fd, null_fd, ret = -EIO;
+
+    snprintf(out, sizeof(out), "%s/ktail_bench.out", opts.dir);
+    fd = open(out, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        err_errno("Failed to create '%s'", out);
+    unlink(out);
+    null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd < 0)
+        err_errno("Failed to open '/dev/null'");
+
+    if (bench_run(argv, fd, &run) || fstat(fd, &sb))
+        goto out;
+    *hash = bench_hash(fd);
+
+    for (unsigned long i = 0; i < opts.runs; ++i) {
+        if (bench_run(argv, null_fd, &run))
+            goto out;
+        walls[i] = run.wall;
+        if (run.ru.ru_maxrss > max_rss)
+            max_rss = run.ru.ru_maxrss;
+    }
+    qsort(walls, opts.runs, sizeof(*walls), bench_cmp_double);
+    wall = walls[opts.runs / 2];
+    syscalls = bench_syscalls(argv, null_fd, &hwm);
+    if (hwm >= 0)
+        max_rss = hwm;
+
+    bench_print_tool("read", tool);
+    printf(",\"lines\":\"%s\",\"file_bytes\":%llu,\"out_bytes\":%lld",
+           lines, (unsigned long long)opts.size, (long long)sb.st_size);
+    printf(",\"runs\":%lu,\"wall_s\":%.6f,\"bytes_per_s\":%.0f",
+           opts.runs, wall, wall > 0 ? sb.st_size / wall : 0);
+    bench_print_syscalls(syscalls);
+    printf(",\"max_rss_kb\":%ld", max_rss);
+    if (ref)
+        printf(",\"match\":%s", *ref == *hash ? "true" : "false");
+    printf("}\n");
+    fflush(stdout);
+
+    ret = 0;
+
+out:
+    close(null_fd);
+    close(fd);
+
+    return ret;
+}
+
+/* reads from fd until len bytes arrived, returns the number of bytes read */
+static unsigned long long bench_drain(int fd, unsigned long long len)
+{
+    char *buf = kmalloc(BENCH_BUF_SIZE);
+    unsigned long long got = 0;
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    while (got < len) {
+        ssize_t rc;
+
+        rc = poll(&pfd, 1, BENCH_TIMEOUT_MS);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            break;
+
+        rc = read(fd, buf, BENCH_BUF_SIZE);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            break;
+        got += rc;
+    }
+    kfree(buf);
+
+    return got;
+}
+
+/*
+ * Appends the data in lines of len bytes. rate is in lines per second, at 0 the
+ * data is written in large blocks as fast as possible.
+ */
+__attribute__((noreturn)) static void bench_writer(const char *file,
+                                                   const char *data,
+                                                   unsigned long long size,
+                                                   size_t len,
+                                                   unsigned long rate)
+{
+    unsigned long long written = 0;
+    double start = bench_now();
+    int fd;
+
+    fd = open(file, O_WRONLY | O_APPEND);
+    if (fd < 0)
+        _exit(EXIT_FAILURE);
+
+    while (written < size) {
+        unsigned long long due = size - written;
+
+        if (rate) {
+            struct timespec tick = { .tv_sec = 0, .tv_nsec = 1000000 };
+            unsigned long long target;
+
+            target = ((unsigned long long)((bench_now() - start) * rate) + 1) * len;
+            if (target > size)
+                target = size;
+            if (target <= written) {
+                nanosleep(&tick, NULL);
+                continue;
+            }
+            due = target - written;
+        } else if (due > BENCH_BUF_SIZE) {
+            due = BENCH_BUF_SIZE;
+        }
+
+        if (bench_write(fd, data + written, due))
+            _exit(EXIT_FAILURE);
+        written += due;
+    }
+
+    _exit(EXIT_SUCCESS);
+}
+
+/*
+ * Follows a file while the writer appends to it. The tool's output is read
+ * through a pipe, the time until all data arrived gives the throughput.
+ */
+static int bench_follow(const char *tool, const char *bin, const char *file,
+                        unsigned long rate)
+{
+    char *argv[] = { (char *)bin, "-f", "-n", "1", (char *)file, NULL };
+    size_t len = (opts.min_line + opts.max_line) / 2;
+    unsigned long long size, got, nr = 0;
+    double start, wall;
+    pid_t pid, writer;
+    struct rusage ru;
+    long hwm;
+    int fds[2], fd, status, ret = -EIO;
+    char *data = NULL;
+
+    size = rate ? (unsigned long long)rate * opts.follow_secs * len :
+        opts.follow_bytes / len * len;
+    if (!size)
+        return 0;
+
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || bench_write(fd, BENCH_START, strlen(BENCH_START)) || close(fd))
+        err_errno("Failed to create '%s'", file);
+
+    if (pipe(fds))
+        err_errno("pipe() failed");
+    pid = bench_spawn(argv, fds[1], 0);
+    close(fds[1]);
+
+    /* the tool is ready once the existing line has been printed */
+    if (bench_drain(fds[0], strlen(BENCH_START)) != strlen(BENCH_START)) {
+        print_err("'%s' didn't print the tail of '%s'", bin, file);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        goto out;
+    }
+
+    /* generated after the spawn, otherwise the copy counts for its max rss */
+    data = kmalloc(size);
+    for (unsigned long long off = 0; off < size; off += len)
+        bench_line(data + off, len, nr++);
+
+    start = bench_now();
+    writer = fork();
+    if (writer < 0)
+        err_errno("fork() failed");
+    if (!writer)
+        bench_writer(file, data, size, len, rate);
+
+    got = bench_drain(fds[0], size);
+    wall = bench_now() - start;
+
+    hwm = bench_hwm(pid);
+    kill(pid, SIGTERM);
+    if (wait4(pid, &status, 0, &ru) < 0)
+        err_errno("wait4() failed");
+    waitpid(writer, NULL, 0);
+
+    if (got != size) {
+        print_err("'%s' printed %llu of %llu bytes", bin, got, size);
+        goto out;
+    }
+
+    bench_print_tool("follow", tool);
+    printf(",\"rate\":%lu,\"line_bytes\":%zu,\"bytes\":%llu", rate, len, size);
+    printf(",\"wall_s\":%.6f,\"bytes_per_s\":%.0f", wall,
+           wall > 0 ? size / wall : 0);
+    printf(",\"cpu_s\":%.6f",
+           ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+    printf(",\"wakeups\":%ld,\"max_rss_kb\":%ld}\n", ru.ru_nvcsw,
+           hwm >= 0 ? hwm : ru.ru_maxrss);
+    fflush(stdout);
+
+    ret = 0;
+
+out:
+    close(fds[0]);
+    kfree(data);
+
+    return ret;
+}
+
+static int bench_read_all(const char *file)
+{
+    char *lines = strdup(opts.lines), *save = NULL;
+    int ret = 0;
+
+    if (!lines)
+        err_errno("strdup() failed");
+
+    for (char *n = strtok_r(lines, ",", &save); n; n = strtok_r(NULL, ",", &save)) {
+        uint64_t ref, hash;
+        int have_ref = 0;
+
+        fprintf(stderr, "read -n %s\n", n);
+        if (*opts.tail) {
+            if (bench_read("tail", opts.tail, file, n, &ref, NULL))
+                ret = -EIO;
+            else
+                have_ref = 1;
+        }
+        if (bench_read("ktail", opts.ktail, file, n, &hash,
+                       have_ref ? &ref : NULL))
+            ret = -EIO;
+    }
+    free(lines);
+
+    return ret;
+}
+
+static int bench_follow_all(const char *file)
+{
+    char *rates = strdup(opts.rates), *save = NULL;
+    int ret = 0;
+
+    if (!rates)
+        err_errno("strdup() failed");
+
+    for (char *r = strtok_r(rates, ",", &save); r; r = strtok_r(NULL, ",", &save)) {
+        unsigned long rate = bench_ulong(r, "rates");
+
+        fprintf(stderr, "follow at %lu lines/s\n", rate);
+        if (*opts.tail && bench_follow("tail", opts.tail, file, rate))
+            ret = -EIO;
+        if (bench_follow("ktail", opts.ktail, file, rate))
+            ret = -EIO;
+    }
+    free(rates);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    char log[PATH_MAX], follow_log[PATH_MAX], ktail[PATH_MAX];
+    unsigned long long size;
+    int c, ret = 0;
+
+    while ((c = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'k':
+            opts.ktail = optarg;
+            break;
+        case 't':
+            opts.tail = optarg;
+            break;
+        case 'd':
+            opts.dir = optarg;
+            break;
+        case 's':
+            if (bench_size(optarg, &opts.size) || !opts.size)
+                err("Invalid argument for --size");
+            break;
+        case 'm':
+            opts.min_line = bench_ulong(optarg, "min-line");
+            break;
+        case 'M':
+            opts.max_line = bench_ulong(optarg, "max-line");
+            break;
+        case 'o':
+            opts.outliers = bench_ulong(optarg, "outliers");
+            break;
+        case 'O':
+            if (bench_size(optarg, &size) || !size || size > SIZE_MAX / 2)
+                err("Invalid argument for --outlier-len");
+            opts.outlier_len = size;
+            break;
+        case 'n':
+            opts.lines = optarg;
+            break;
+        case 'r':
+            opts.runs = bench_ulong(optarg, "runs");
+            break;
+        case 'R':
+            opts.rates = optarg;
+            break;
+        case 'S':
+            opts.follow_secs = bench_ulong(optarg, "follow-secs");
+            break;
+        case 'B':
+            if (bench_size(optarg, &opts.follow_bytes))
+                err("Invalid argument for --follow-bytes");
+            break;
+        case 'x':
+            opts.seed = bench_ulong(optarg, "seed") | 1;
+            break;
+        case 'K':
+            opts.keep = 1;
+            break;
+        case 'h':
+            print_usage_and_die(0);
+        default:
+            print_usage_and_die(1);
+        }
+    }
+    if (optind != argc)
+        print_usage_and_die(1);
+    if (!opts.min_line || opts.max_line < opts.min_line)
+        err("Invalid line lengths");
+    if (!opts.runs || opts.runs > BENCH_MAX_RUNS)
+        err("Invalid argument for --runs");
+
+    /* by default the ktail of the same build is measured */
+    if (!opts.ktail) {
+        if (path_dirname(argv[0], ktail, sizeof(ktail)) ||
+            strlen(ktail) + sizeof("/ktail") > sizeof(ktail))
+            err("Cannot locate ktail, use --ktail");
+        strcat(ktail, "/ktail");
+        opts.ktail = ktail;
+    }
+
+    snprintf(log, sizeof(log), "%s/ktail_bench.log", opts.dir);
+    snprintf(follow_log, sizeof(follow_log), "%s/ktail_bench_follow.log",
+             opts.dir);
+
+    fprintf(stderr, "generating %llu bytes in '%s'\n", opts.size, log);
+    bench_generate(log);
+
+    if (bench_read_all(log))
+        ret = -EIO;
+    if (bench_follow_all(follow_log))
+        ret = -EIO;
+
+    if (!opts.keep) {
+        unlink(log);
+        unlink(follow_log);
+    }
+
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
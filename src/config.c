@@ -1,22 +0,0 @@
-/*
- * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
- *
- * This file is part of Ktail.
- *
- * Ktail is free software: you can redistribute it and/or modify
- * it under the terms of the GNU General Public License as published by
- * the Free Software Foundation, either version 3 of the License, or
- * (at your option) any later version.
- *
- * Ktail is distributed in the hope that it will be useful,
- * but WITHOUT ANY WARRANTY; without even the implied warranty of
- * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
- * GNU General Public License for more details.
- *
- * You should have received a copy of the GNU General Public License
- * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
- */
-
-#include "config.h"
-
-struct config config;
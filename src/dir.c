@@ -0,0 +1,450 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+
+#include "dir.h"
+
+#include "lindex.h"
+#include "utils.h"
+
+struct ktail_dir *dir_init(struct ktail_follower *f,
+                           const struct ktail_options *opts, const char *path,
+                           const char *pattern, ktail_dir_fn fn, void *arg)
+{
+    struct ktail_dir *dir = kzmalloc(sizeof(*dir));
+    size_t len = strlen(path);
+
+    /* "logs/" would give "logs//file" */
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    dir->path = kmalloc(len + 1);
+    memcpy(dir->path, path, len);
+    dir->path[len] = '\0';
+
+    pattern = pattern ? pattern : "*";
+    dir->pattern = kmalloc(strlen(pattern) + 1);
+    strcpy(dir->pattern, pattern);
+
+    dir->watch.path = dir->path;
+    dir->watch.wd = -1;
+    dir->f = f;
+    dir->opts = opts;
+    dir->fn = fn;
+    dir->arg = arg;
+    dir->cap = 64;
+    dir->files = kzmalloc_array(dir->cap, sizeof(*dir->files));
+
+    return dir;
+}
+
+static void dir_close_file(struct ktail_dir *dir, struct dir_file *file)
+{
+    if (dir->fn)
+        dir->fn(file->ctx, KTAIL_DIR_REMOVED, dir->arg);
+    ktail_close(file->ctx);
+    ktail_free(file->ctx);
+    kfree(file);
+}
+
+void dir_free(struct ktail_dir *dir)
+{
+    if (!dir)
+        return;
+
+    for (size_t i = 0; i < dir->cap; ++i)
+        if (dir->files[i])
+            dir_close_file(dir, dir->files[i]);
+
+    kfree(dir->files);
+    kfree(dir->gone);
+    kfree(dir->watch.names);
+    kfree(dir->path);
+    kfree(dir->pattern);
+    kfree(dir);
+}
+
+/* slot of name, or the empty one where it belongs */
+static size_t dir_slot(const struct ktail_dir *dir, const char *name,
+                       size_t hash)
+{
+    size_t mask = dir->cap - 1, i = hash & mask;
+
+    while (dir->files[i] && (dir->files[i]->hash != hash ||
+                             strcmp(dir->files[i]->name, name)))
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+/* the table is kept at most half full */
+static void dir_insert(struct ktail_dir *dir, struct dir_file *file)
+{
+    if ((dir->nr_files + 1) * 2 > dir->cap) {
+        struct dir_file **files = dir->files;
+        size_t cap = dir->cap;
+
+        dir->cap *= 2;
+        dir->files = kzmalloc_array(dir->cap, sizeof(*dir->files));
+        for (size_t i = 0; i < cap; ++i)
+            if (files[i])
+                dir->files[dir_slot(dir, files[i]->name,
+                                    files[i]->hash)] = files[i];
+        kfree(files);
+    }
+
+    dir->files[dir_slot(dir, file->name, file->hash)] = file;
+    dir->nr_files++;
+}
+
+/* removes slot i, the following entries are shifted back into the hole */
+static void dir_unlink(struct ktail_dir *dir, size_t i)
+{
+    size_t mask = dir->cap - 1, j = i;
+
+    dir->files[i] = NULL;
+    dir->nr_files--;
+
+    while (42) {
+        size_t home;
+
+        j = (j + 1) & mask;
+        if (!dir->files[j])
+            break;
+
+        /* entries whose home is cyclically within (i, j] stay */
+        home = dir->files[j]->hash & mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        dir->files[i] = dir->files[j];
+        dir->files[j] = NULL;
+        i = j;
+    }
+}
+
+/* sidecars of --index are never followed */
+static int dir_match(const struct ktail_dir *dir, const char *name)
+{
+    size_t len = strlen(name), suffix = sizeof(LINDEX_SUFFIX) - 1;
+
+    if (len > suffix && !strcmp(name + len - suffix, LINDEX_SUFFIX))
+        return 0;
+
+    return !fnmatch(dir->pattern, name, FNM_PERIOD);
+}
+
+/*
+ * Whether the entry is still the followed file. d_ino differs from st_ino on
+ * some filesystems, so a mismatch is verified.
+ */
+static int dir_same(int dfd, const struct dirent *de,
+                    const struct ktail_context *ctx)
+{
+    struct stat sb;
+
+    if (de->d_ino == ctx->ino)
+        return 1;
+
+    return fstatat(dfd, de->d_name, &sb, 0) ||
+        (sb.st_dev == ctx->dev && sb.st_ino == ctx->ino);
+}
+
+/* readdir() tells the type, only symlinks and unknown ones need a stat */
+static int dir_regular(int dfd, const struct dirent *de)
+{
+    struct stat sb;
+
+#ifdef DT_REG
+    if (de->d_type == DT_REG)
+        return 1;
+    if (de->d_type != DT_UNKNOWN && de->d_type != DT_LNK)
+        return 0;
+#endif
+
+    return !fstatat(dfd, de->d_name, &sb, 0) && S_ISREG(sb.st_mode);
+}
+
+/* a moved file continues where its old name stopped */
+static int dir_resume(struct ktail_dir *dir, struct ktail_context *ctx)
+{
+    for (size_t i = 0; i < dir->nr_gone; ++i) {
+        if (dir->gone[i].dev == ctx->dev && dir->gone[i].ino == ctx->ino) {
+            ctx->bytes = dir->gone[i].bytes;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Opens and prints a file. Files of the initial scan get their tail printed,
+ * later ones everything. Files, which cannot be opened, are skipped; only
+ * errors of the output are returned.
+ */
+static int dir_add(struct ktail_dir *dir, const char *name, int initial)
+{
+    size_t dlen = strlen(dir->path), nlen = strlen(name);
+    struct dir_file *file = kmalloc(sizeof(*file) + dlen + nlen + 2);
+    struct ktail_context *ctx;
+    int ret;
+
+    memcpy(file->path, dir->path, dlen);
+    file->path[dlen] = '/';
+    memcpy(file->path + dlen + 1, name, nlen + 1);
+    file->name = file->path + dlen + 1;
+    file->hash = path_hash(name);
+    file->gen = dir->gen;
+
+    ctx = file->ctx = ktail_init(file->path, dir->opts);
+    ctx->in_dir = 1;
+    if (ktail_open(ctx))
+        goto out0;
+
+    ret = dir->fn ? dir->fn(ctx, KTAIL_DIR_ADDED, dir->arg) : 0;
+    if (ret < 0)
+        goto out1;
+
+    /* watched before it's read, so that no write is missed */
+    if (ktail_follower_add(dir->f, ctx))
+        goto out2;
+
+    if (!ret)
+        ret = dir_resume(dir, ctx);
+    if (ret || !initial)
+        ret = ktail_read_and_print(ctx);
+    else
+        ret = ktail_read(ctx) || ktail_print(ctx) ? -EIO : 0;
+
+    dir_insert(dir, file);
+
+    return ret;
+
+out2:
+    if (dir->fn)
+        dir->fn(ctx, KTAIL_DIR_REMOVED, dir->arg);
+out1:
+    ktail_close(ctx);
+out0:
+    ktail_free(ctx);
+    kfree(file);
+
+    return 0;
+}
+
+static void dir_gone_add(struct ktail_dir *dir, const struct ktail_context *ctx)
+{
+    struct dir_gone *gone = kmalloc_array(dir->nr_gone + 1, sizeof(*gone));
+
+    if (dir->nr_gone)
+        memcpy(gone, dir->gone, dir->nr_gone * sizeof(*gone));
+    kfree(dir->gone);
+    dir->gone = gone;
+
+    /* an unterminated last line is printed again as a whole */
+    gone[dir->nr_gone].dev = ctx->dev;
+    gone[dir->nr_gone].ino = ctx->ino;
+    gone[dir->nr_gone].bytes = ctx->bytes - ctx->line_len;
+    dir->nr_gone++;
+}
+
+/* prints the rest of the file in slot i and drops it */
+static int dir_remove(struct ktail_dir *dir, size_t i)
+{
+    struct dir_file *file = dir->files[i];
+    struct ktail_context *ctx = file->ctx;
+    struct stat sb;
+    int ret;
+
+    ret = ktail_read_and_print(ctx);
+
+    /* still linked, so it has been moved */
+    if (!fstat(ctx->fd, &sb) && sb.st_nlink)
+        dir_gone_add(dir, ctx);
+
+    ktail_follower_remove(dir->f, ctx);
+    dir_unlink(dir, i);
+    dir_close_file(dir, file);
+
+    return ret;
+}
+
+static int dir_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Compares the directory with the table. Vanished files are dropped before new
+ * ones are added, so that renamed files are recognized.
+ */
+static int dir_rescan(struct ktail_dir *dir, int initial)
+{
+    char **names = NULL;
+    size_t nr = 0, cap = 0;
+    struct dirent *de;
+    int ret = 0;
+    DIR *d;
+
+    d = opendir(dir->path);
+    if (!d) {
+        print_err_errno("Failed to open directory '%s'", dir->path);
+        return -EIO;
+    }
+
+    dir->gen++;
+    while ((de = readdir(d))) {
+        size_t hash, i, len;
+
+        if (!dir_match(dir, de->d_name))
+            continue;
+
+        /* a replaced file is dropped and added again */
+        hash = path_hash(de->d_name);
+        i = dir_slot(dir, de->d_name, hash);
+        if (dir->files[i] && dir_same(dirfd(d), de, dir->files[i]->ctx)) {
+            dir->files[i]->gen = dir->gen;
+            continue;
+        }
+        if (!dir_regular(dirfd(d), de))
+            continue;
+
+        if (nr == cap) {
+            char **tmp;
+
+            cap = cap ? cap * 2 : 64;
+            tmp = kmalloc_array(cap, sizeof(*tmp));
+            if (nr)
+                memcpy(tmp, names, nr * sizeof(*tmp));
+            kfree(names);
+            names = tmp;
+        }
+        len = strlen(de->d_name) + 1;
+        names[nr] = kmalloc(len);
+        memcpy(names[nr++], de->d_name, len);
+    }
+    closedir(d);
+
+    /* a removal may shift the next entry into slot i */
+    for (size_t i = 0; i < dir->cap && !ret; ) {
+        if (dir->files[i] && dir->files[i]->gen != dir->gen)
+            ret = dir_remove(dir, i);
+        else
+            ++i;
+    }
+
+    /* in the order of ls */
+    if (nr)
+        qsort(names, nr, sizeof(*names), dir_cmp);
+    for (size_t i = 0; i < nr; ++i) {
+        if (!ret)
+            ret = dir_add(dir, names[i], initial);
+        kfree(names[i]);
+    }
+    kfree(names);
+
+    return ret;
+}
+
+int dir_scan(struct ktail_dir *dir)
+{
+    ASSERT_PARAM_NOT_NULL(dir);
+
+    return dir_rescan(dir, 1);
+}
+
+/* a created entry, which may replace a followed file */
+static int dir_created(struct ktail_dir *dir, const char *name)
+{
+    size_t hash = path_hash(name), i = dir_slot(dir, name, hash);
+    char path[PATH_MAX];
+    struct stat sb;
+    int ret;
+
+    if (snprintf(path, sizeof(path), "%s/%s", dir->path, name) >=
+        (int)sizeof(path))
+        return 0;
+    if (stat(path, &sb) || !S_ISREG(sb.st_mode))
+        return 0;
+
+    if (dir->files[i]) {
+        const struct ktail_context *ctx = dir->files[i]->ctx;
+
+        if (ctx->dev == sb.st_dev && ctx->ino == sb.st_ino)
+            return 0;
+        ret = dir_remove(dir, i);
+        if (ret)
+            return ret;
+    }
+
+    return dir_add(dir, name, 0);
+}
+
+/* the names queued by the backend, in the order of the events */
+static int dir_names(struct ktail_dir *dir)
+{
+    const char *p = dir->watch.names, *end = p + dir->watch.names_len;
+    int ret = 0;
+
+    for (; p < end && !ret; p += strlen(p) + 1) {
+        const char *name = p + 1;
+        size_t i;
+
+        if (!dir_match(dir, name))
+            continue;
+        if (*p == '+') {
+            ret = dir_created(dir, name);
+            continue;
+        }
+
+        i = dir_slot(dir, name, path_hash(name));
+        if (dir->files[i])
+            ret = dir_remove(dir, i);
+    }
+
+    return ret;
+}
+
+int dir_update(struct ktail_dir *dir)
+{
+    struct watch_dir *watch;
+    int ret;
+
+    ASSERT_PARAM_NOT_NULL(dir);
+
+    watch = &dir->watch;
+    ret = watch->rescan ? dir_rescan(dir, 0) : dir_names(dir);
+
+    watch->ready = 0;
+    watch->rescan = 0;
+    watch->names_len = 0;
+    dir->nr_gone = 0;
+
+    return ret;
+}
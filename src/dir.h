@@ -0,0 +1,77 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DIR_H_
+#define _DIR_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "ktail.h"
+#include "wait.h"
+
+/*
+ * Files of a --dir directory by name. The names are hashed by open
+ * addressing, so the lookups of created and removed entries don't depend on
+ * the number of files.
+ */
+struct dir_file {
+    struct ktail_context *ctx;
+    size_t hash;
+    unsigned long gen;          /* last rescan which saw the file */
+    const char *name;           /* points into path */
+    char path[];
+};
+
+/* a file moved away during an update, it may show up under another name */
+struct dir_gone {
+    dev_t dev;
+    ino_t ino;
+    size_t bytes;
+};
+
+struct ktail_dir {
+    struct watch_dir watch;
+    struct ktail_follower *f;
+    const struct ktail_options *opts;
+    char *path;
+    char *pattern;
+    ktail_dir_fn fn;
+    void *arg;
+    struct dir_file **files;
+    size_t nr_files;
+    size_t cap;                 /* power of two */
+    unsigned long gen;
+    struct dir_gone *gone;
+    size_t nr_gone;
+};
+
+struct ktail_dir *dir_init(struct ktail_follower *f,
+                           const struct ktail_options *opts, const char *path,
+                           const char *pattern, ktail_dir_fn fn, void *arg);
+/* closes the files without printing them, the watcher has to be gone */
+void dir_free(struct ktail_dir *dir);
+
+/* reads the directory and prints the tails of the matching files */
+int dir_scan(struct ktail_dir *dir);
+
+/* applies the entries reported by the watcher since the last update */
+int dir_update(struct ktail_dir *dir);
+
+#endif /* _DIR_H_ */
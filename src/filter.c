@@ -0,0 +1,381 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <regex.h>
+
+#include "filter.h"
+
+#include "scan.h"
+#include "utils.h"
+#include "ktail_config.h"
+
+/*
+ * Aho-Corasick automaton of several literals. The transitions are resolved for
+ * all bytes, so matching costs one table lookup per byte.
+ */
+struct ac {
+    uint32_t (*next)[256];
+    uint8_t *out;               /* a literal ends in this state */
+    size_t nr, cap;
+    /* bytes leaving the root, if there are few of them */
+    char first[4];
+    size_t nr_first;
+};
+
+struct filter_set {
+    char **literals;
+    size_t *lens;
+    size_t nr_literals;
+    struct ac *ac;              /* built once there are two literals */
+    regex_t *regs;
+    size_t nr_regs;
+};
+
+struct filter {
+    int regex;
+    struct filter_set match;
+    struct filter_set exclude;
+#ifndef HAVE_REG_STARTEND
+    /* regexec() needs a terminated copy of the line */
+    char *buf;
+    size_t buf_size;
+#endif
+};
+
+static uint32_t ac_state(struct ac *ac)
+{
+    if (ac->nr == ac->cap) {
+        uint32_t (*next)[256];
+        uint8_t *out;
+
+        ac->cap = ac->cap ? ac->cap * 2 : 64;
+        next = kmalloc_array(ac->cap, sizeof(*next));
+        out = kmalloc_array(ac->cap, sizeof(*out));
+        if (ac->nr) {
+            memcpy(next, ac->next, ac->nr * sizeof(*next));
+            memcpy(out, ac->out, ac->nr * sizeof(*out));
+        }
+        kfree(ac->next);
+        kfree(ac->out);
+        ac->next = next;
+        ac->out = out;
+    }
+
+    /* 0 is the root, so it means "no edge" while building the trie */
+    memset(ac->next[ac->nr], 0, sizeof(ac->next[0]));
+    ac->out[ac->nr] = 0;
+
+    return ac->nr++;
+}
+
+static void ac_free(struct ac *ac)
+{
+    if (!ac)
+        return;
+
+    kfree(ac->next);
+    kfree(ac->out);
+    kfree(ac);
+}
+
+static struct ac *ac_build(char **literals, const size_t *lens, size_t nr)
+{
+    struct ac *ac = kzmalloc(sizeof(*ac));
+    uint32_t *fail, *queue;
+    size_t head = 0, tail = 0;
+
+    ac_state(ac);
+
+    /* trie */
+    for (size_t i = 0; i < nr; ++i) {
+        uint32_t s = 0;
+
+        for (size_t j = 0; j < lens[i]; ++j) {
+            unsigned char c = literals[i][j];
+
+            if (!ac->next[s][c]) {
+                uint32_t t = ac_state(ac);
+                ac->next[s][c] = t;
+            }
+            s = ac->next[s][c];
+        }
+        ac->out[s] = 1;
+    }
+
+    /* failure links in bfs order, missing edges follow them */
+    fail = kzmalloc_array(ac->nr, sizeof(*fail));
+    queue = kmalloc_array(ac->nr, sizeof(*queue));
+
+    for (int c = 0; c < 256; ++c) {
+        uint32_t t = ac->next[0][c];
+
+        if (t) {
+            fail[t] = 0;
+            queue[tail++] = t;
+        }
+    }
+
+    /* the root is left rarely, so the scan can skip to these bytes */
+    if (tail <= sizeof(ac->first) && !ac->out[0]) {
+        for (int c = 0; c < 256; ++c)
+            if (ac->next[0][c])
+                ac->first[ac->nr_first++] = c;
+    }
+
+    while (head < tail) {
+        uint32_t s = queue[head++];
+
+        ac->out[s] |= ac->out[fail[s]];
+        for (int c = 0; c < 256; ++c) {
+            uint32_t t = ac->next[s][c];
+
+            if (t) {
+                fail[t] = ac->next[fail[s]][c];
+                queue[tail++] = t;
+            } else {
+                ac->next[s][c] = ac->next[fail[s]][c];
+            }
+        }
+    }
+
+    kfree(fail);
+    kfree(queue);
+
+    return ac;
+}
+
+/* returns the last byte of the first match */
+static const char *ac_find(const struct ac *ac, const char *buf, size_t len)
+{
+    uint32_t s = 0;
+
+    /* the empty literal */
+    if (ac->out[0])
+        return buf;
+
+    for (size_t i = 0; i < len; ++i) {
+        if (!s && ac->nr_first) {
+            const char *p = scan_any(buf + i, len - i, ac->first, ac->nr_first);
+
+            if (!p)
+                return NULL;
+            i = p - buf;
+        }
+
+        s = ac->next[s][(unsigned char)buf[i]];
+        if (ac->out[s])
+            return buf + i;
+    }
+
+    return NULL;
+}
+
+struct filter *filter_init(int regex)
+{
+    struct filter *f = kzmalloc(sizeof(*f));
+
+    f->regex = regex;
+
+    return f;
+}
+
+static void filter_set_free(struct filter_set *set)
+{
+    for (size_t i = 0; i < set->nr_literals; ++i)
+        kfree(set->literals[i]);
+    kfree(set->literals);
+    kfree(set->lens);
+    ac_free(set->ac);
+
+    for (size_t i = 0; i < set->nr_regs; ++i)
+        regfree(&set->regs[i]);
+    kfree(set->regs);
+}
+
+void filter_free(struct filter *f)
+{
+    if (!f)
+        return;
+
+    filter_set_free(&f->match);
+    filter_set_free(&f->exclude);
+#ifndef HAVE_REG_STARTEND
+    kfree(f->buf);
+#endif
+    kfree(f);
+}
+
+/* grows an array of nr elements by one */
+static void *filter_grow(void *array, size_t nr, size_t size)
+{
+    void *new = kmalloc_array(nr + 1, size);
+
+    if (nr)
+        memcpy(new, array, nr * size);
+    kfree(array);
+
+    return new;
+}
+
+static int filter_add_regex(struct filter_set *set, const char *pattern)
+{
+    char msg[256];
+    int ret;
+
+    set->regs = filter_grow(set->regs, set->nr_regs, sizeof(*set->regs));
+
+    ret = regcomp(&set->regs[set->nr_regs], pattern, REG_EXTENDED | REG_NOSUB);
+    if (ret) {
+        regerror(ret, &set->regs[set->nr_regs], msg, sizeof(msg));
+        print_err("Invalid regular expression '%s': %s", pattern, msg);
+        return -EINVAL;
+    }
+    set->nr_regs++;
+
+    return 0;
+}
+
+int filter_add(struct filter *f, const char *pattern, int exclude)
+{
+    struct filter_set *set;
+    size_t len;
+
+    ASSERT_PARAM_NOT_NULL(f);
+    ASSERT_PARAM_NOT_NULL(pattern);
+
+    set = exclude ? &f->exclude : &f->match;
+    if (f->regex)
+        return filter_add_regex(set, pattern);
+
+    len = strlen(pattern);
+    set->literals = filter_grow(set->literals, set->nr_literals,
+                                sizeof(*set->literals));
+    set->lens = filter_grow(set->lens, set->nr_literals, sizeof(*set->lens));
+    set->literals[set->nr_literals] = kmalloc(len + 1);
+    memcpy(set->literals[set->nr_literals], pattern, len + 1);
+    set->lens[set->nr_literals++] = len;
+
+    ac_free(set->ac);
+    set->ac = NULL;
+    if (set->nr_literals > 1)
+        set->ac = ac_build(set->literals, set->lens, set->nr_literals);
+
+    return 0;
+}
+
+static int filter_regexec(struct filter *f, const regex_t *reg,
+                          const char *line, size_t len)
+{
+#ifdef HAVE_REG_STARTEND
+    regmatch_t match = { .rm_so = 0, .rm_eo = len };
+
+    (void)f;
+
+    return !regexec(reg, line, 1, &match, REG_STARTEND);
+#else
+    if (len >= f->buf_size) {
+        kfree(f->buf);
+        f->buf_size = len + 1;
+        f->buf = kmalloc(f->buf_size);
+    }
+    memcpy(f->buf, line, len);
+    f->buf[len] = '\0';
+
+    return !regexec(reg, f->buf, 0, NULL, 0);
+#endif
+}
+
+/* returns a byte of the first literal found in buf */
+static const char *filter_set_find(const struct filter_set *set,
+                                   const char *buf, size_t len)
+{
+    if (set->ac)
+        return ac_find(set->ac, buf, len);
+    if (!set->lens[0])
+        return buf;
+
+    return scan_substr(buf, len, set->literals[0], set->lens[0]);
+}
+
+static int filter_set_match(struct filter *f, const struct filter_set *set,
+                            const char *line, size_t len)
+{
+    if (set->nr_literals && filter_set_find(set, line, len))
+        return 1;
+
+    for (size_t i = 0; i < set->nr_regs; ++i)
+        if (filter_regexec(f, &set->regs[i], line, len))
+            return 1;
+
+    return 0;
+}
+
+int filter_line(struct filter *f, const char *line, size_t len)
+{
+    if (!f)
+        return 1;
+
+    /* the newline isn't part of the line, so $ works */
+    if (len && line[len - 1] == '\n')
+        len--;
+
+    if ((f->match.nr_literals || f->match.nr_regs) &&
+        !filter_set_match(f, &f->match, line, len))
+        return 0;
+
+    return !filter_set_match(f, &f->exclude, line, len);
+}
+
+const char *filter_find(struct filter *f, const char *buf, size_t len,
+                        size_t *line_len)
+{
+    const char *p = buf, *end = buf + len;
+
+    while (p < end) {
+        const char *line = p, *nl;
+        size_t n;
+
+        /*
+         * Literals are searched in the whole buffer, which is a lot faster than
+         * searching line by line. Only the lines with a hit are checked.
+         */
+        if (f && f->match.nr_literals) {
+            const char *hit = filter_set_find(&f->match, p, end - p);
+
+            if (!hit)
+                return NULL;
+            nl = scan_newline_reverse(p, hit - p);
+            line = nl ? nl + 1 : p;
+        }
+
+        nl = scan_newline(line, end - line);
+        n = nl ? (size_t)(nl - line + 1) : (size_t)(end - line);
+        if (filter_line(f, line, n)) {
+            *line_len = n;
+            return line;
+        }
+        p = line + n;
+    }
+
+    return NULL;
+}
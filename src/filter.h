@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _FILTER_H_
+#define _FILTER_H_
+
+#include <stddef.h>
+
+struct filter;
+
+/*
+ * Line filter of --match and --exclude. A line passes if it matches any of the
+ * match patterns (if there are some) and none of the exclude patterns.
+ * Patterns are literals, or POSIX extended regular expressions if regex is set.
+ */
+struct filter *filter_init(int regex);
+void filter_free(struct filter *f);
+int filter_add(struct filter *f, const char *pattern, int exclude);
+
+/* line includes the newline, if any, a NULL filter passes every line */
+int filter_line(struct filter *f, const char *line, size_t len);
+
+/*
+ * Returns the first line of buf, which passes the filter, and its length. buf
+ * consists of whole lines.
+ */
+const char *filter_find(struct filter *f, const char *buf, size_t len,
+                        size_t *line_len);
+
+#endif /* _FILTER_H_ */
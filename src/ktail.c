@@ -17,290 +17,1809 @@
  * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/time.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <limits.h>
 
 #include "ktail.h"
 
+#include "dir.h"
+#include "lindex.h"
+#include "output.h"
+#include "pscan.h"
+#include "ring.h"
+#include "scan.h"
+#include "stats.h"
+#include "tstamp.h"
+#include "uring.h"
+#include "wait.h"
 #include "utils.h"
-#include "config.h"
+#include "filter.h"
 #include "ktail_config.h"
 
-#if !defined(HAVE_INOTIFY) && !defined(HAVE_KQUEUE)
-#define SLEEP_INTERVALL 500
-#endif
-#ifdef HAVE_INOTIFY
-#define BUF_SIZE (1 * sizeof(struct inotify_event))
-#endif
-
-static size_t MAX_LINE;
+#define BLOCK_SIZE (64 * 1024)
+#define HEADER_SIZE (PATH_MAX + 16)
+#define URING_BUFS 32
+#define FILTER_CHUNK_SIZE (1024 * 1024)
+#define URING_ENTRIES 128
+/* the tail of a pipe is held in memory, a line longer than that is cut */
+#define STREAM_MAX_BYTES (64 * 1024 * 1024)
+/* with -f, the data of a pipe is the tail until it stays quiet this long */
+#define STREAM_SETTLE_MSEC 50
 
-__attribute__((constructor)) static void init(void)
+void ktail_options_init(struct ktail_options *opts)
 {
-    long res = sysconf(_SC_LINE_MAX);
-    if (res < 0)
-        err_errno("sysconf() failed");
-    if (res == 0)
-        err("sysconf() returned 0 for _SC_LINE_MAX");
-    MAX_LINE = (size_t)res + 1;
+    memset(opts, 0, sizeof(*opts));
+    opts->n = 1000;
+    opts->poll_min = 500;
+    opts->poll_max = 500000;
 }
 
-static inline size_t idx(const size_t line, const size_t off)
+struct ktail_context *ktail_init(const char *file,
+                                 const struct ktail_options *opts)
 {
-    return line * MAX_LINE + off;
-}
-
-struct ktail_context *ktail_init(void)
-{
-    /* allocate memory only once! */
     struct ktail_context *ctx = (struct ktail_context *)kzmalloc(sizeof(*ctx));
-    ctx->data = (char *)kmalloc_array(MAX_LINE, config.n);
+
+    ctx->file = file;
+    ctx->opts = opts;
+    ctx->fd = -1;
+    ctx->wd = -1;
+    ctx->dir_watch = -1;
 
     return ctx;
 }
 
+int ktail_is_stdin(const char *file)
+{
+    return file && !strcmp(file, "-");
+}
+
 void ktail_free(struct ktail_context *ctx)
 {
     ASSERT_PARAM_NOT_NULL_VOID(ctx);
 
-    kfree(ctx->data);
+    if (ctx->opts->output->last_header == ctx)
+        ctx->opts->output->last_header = NULL;
+
+    lindex_close(ctx->index);
+    kfree(ctx->buf);
+    kfree(ctx->line);
+    ring_free(ctx->ring);
     kfree(ctx);
 }
 
-int ktail_wait_init(struct ktail_context *ctx)
+/* the block buffer is only needed by the pread and stream engine */
+static char *ktail_buf(struct ktail_context *ctx)
 {
-    ASSERT_PARAM_NOT_NULL(ctx);
+    if (!ctx->buf)
+        ctx->buf = (char *)kmalloc(BLOCK_SIZE);
+
+    return ctx->buf;
+}
+
+/*
+ * Formats "==> file <==" if the output switches to another file. Callbacks
+ * know the file from the context.
+ */
+static size_t ktail_format_header(const struct ktail_context *ctx, char *buf,
+                                  size_t size)
+{
+    struct output *out = ctx->opts->output;
+    int len;
+
+    if (!ctx->opts->headers || out->fn || out->last_header == ctx)
+        return 0;
+
+    len = snprintf(buf, size, "%s==> %s <==\n",
+                   out->headers_printed ? "\n" : "",
+                   ktail_is_stdin(ctx->file) ? "standard input" : ctx->file);
+    out->last_header = ctx;
+    out->headers_printed = 1;
+
+    return len < (int)size ? (size_t)len : size - 1;
+}
+
+static int ktail_print_header(const struct ktail_context *ctx)
+{
+    char header[HEADER_SIZE];
+    size_t len = ktail_format_header(ctx, header, sizeof(header));
+
+    return len ? output_write(ctx->opts->output, header, len) : 0;
+}
+
+/* passes buf, which is at offset off in the file, to the output */
+static int ktail_emit(struct ktail_context *ctx, const char *buf, size_t len,
+                      size_t off)
+{
+    struct output *out = ctx->opts->output;
+    struct ktail_line slice = { buf, len, off };
+
+    if (!out->fn)
+        return output_write(out, buf, len);
+
+    return len ? out->fn(ctx, &slice, out->arg) : 0;
+}
 
-#ifdef HAVE_KQUEUE
-    ctx->fd = open(config.file, O_RDONLY);
+/* data is passed line by line if it's filtered or the callback wants lines */
+static int ktail_by_line(const struct ktail_context *ctx)
+{
+    return ctx->opts->filter || ctx->opts->output->lines;
+}
+
+/*
+ * (Re-)Maps the whole file, if its size changed. The old mapping is kept as
+ * long as the size stays the same.
+ */
+static int ktail_remap(struct ktail_context *ctx)
+{
+    struct stats *stats = ctx->opts->stats;
+    struct stat sb;
+    void *map;
+
+    STATS_INC(stats, syscalls);
+    if (fstat(ctx->fd, &sb))
+        return -errno;
+
+    if ((size_t)sb.st_size == ctx->map_size)
+        return 0;
+
+    if (ctx->map) {
+        STATS_INC(stats, syscalls);
+        munmap(ctx->map, ctx->map_size);
+    }
+    ctx->map = NULL;
+    ctx->map_size = 0;
+
+    /* empty files cannot be mapped, they're mapped once they grow */
+    if (!sb.st_size)
+        return 0;
+
+    STATS_INC(stats, syscalls);
+    map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, ctx->fd, 0);
+    if (map == MAP_FAILED)
+        return -errno;
+
+    ctx->map = map;
+    ctx->map_size = sb.st_size;
+
+    return 0;
+}
+
+/*
+ * A FIFO opened for writing as well never reports the end of the data, so -f
+ * keeps reading it across writers. Also, the open doesn't wait for a writer.
+ * Pipes behind links like /dev/fd/63 end with their writers instead.
+ */
+static int ktail_open_flags(const struct ktail_context *ctx)
+{
+    struct stat sb;
+
+    if (ctx->opts->follow && !lstat(ctx->file, &sb) && S_ISFIFO(sb.st_mode))
+        return O_RDWR;
+
+    return O_RDONLY;
+}
+
+static int ktail_open_file(struct ktail_context *ctx)
+{
+    struct stat sb;
+
+    ctx->fd = ktail_is_stdin(ctx->file) ? dup(STDIN_FILENO) :
+        open(ctx->file, ktail_open_flags(ctx));
     if (ctx->fd < 0) {
         print_err_errno("open() failed");
         return -EIO;
     }
 
-    ctx->kq = kqueue();
-    if (ctx->kq < 0) {
-        print_err_errno("kqueue() failed");
-        return -ENOMEM;
+    if (fstat(ctx->fd, &sb)) {
+        print_err_errno("fstat() failed");
+        close(ctx->fd);
+        return -EIO;
     }
+    ctx->dev = sb.st_dev;
+    ctx->ino = sb.st_ino;
+    ctx->size = sb.st_size;
 
-    EV_SET(&ctx->change, ctx->fd, EVFILT_VNODE,
-           EV_ADD | EV_ENABLE | EV_ONESHOT,
-           NOTE_EXTEND | NOTE_WRITE,
-           0, 0);
-#elif HAVE_INOTIFY
-    ctx->fd = inotify_init();
-    if (ctx->fd < 0) {
-        print_err_errno("inotify_init() failed");
-        return -ENOMEM;
-    }
-    ctx->wd = inotify_add_watch(ctx->fd, config.file, IN_MODIFY);
-    if (ctx->wd < 0) {
-        print_err_errno("inotify_add_watch() failed");
-        return -ENOMEM;
-    }
-#endif
+    /*
+     * Regular files are mapped. If that isn't possible, they're read
+     * backwards with pread(). Everything else is read from the beginning.
+     */
+    if (!S_ISREG(sb.st_mode))
+        ctx->engine = KTAIL_ENGINE_STREAM;
+    else if (ktail_remap(ctx))
+        ctx->engine = KTAIL_ENGINE_PREAD;
+    else
+        ctx->engine = KTAIL_ENGINE_MMAP;
+
+    return 0;
+}
+
+static void ktail_close_file(struct ktail_context *ctx)
+{
+    if (ctx->map)
+        munmap(ctx->map, ctx->map_size);
+    ctx->map = NULL;
+    ctx->map_size = 0;
+
+    close(ctx->fd);
+    ctx->fd = -1;
+}
+
+int ktail_open(struct ktail_context *ctx)
+{
+    ASSERT_PARAM_NOT_NULL(ctx);
+
+    if (ktail_open_file(ctx))
+        return -EIO;
+
+    /* the index survives reopens, it starts over once the inode changes */
+    if (ctx->opts->index && ctx->engine != KTAIL_ENGINE_STREAM &&
+        !ktail_is_stdin(ctx->file))
+        ctx->index = lindex_open(ctx);
 
     return 0;
 }
 
-int ktail_wait(struct ktail_context *ctx)
+int ktail_reopen(struct ktail_context *ctx)
 {
     ASSERT_PARAM_NOT_NULL(ctx);
 
-#ifdef HAVE_KQUEUE
-    struct kevent event;
-    int nev;
+    STATS_INC(ctx->opts->stats, reopens);
+    ktail_close_file(ctx);
+    if (ktail_open_file(ctx))
+        return -EIO;
+
+    /* the new file is followed from its beginning */
+    ctx->bytes = 0;
+    ctx->line_len = 0;
 
-    /* zZz */
-    while (42) {
-        nev = kevent(ctx->kq, &ctx->change, 1, &event, 1, NULL);
-        if (nev < 0) {
-            if (errno == EINTR)
-                break;
-            print_err_errno("kevent() failed");
-            return -ENOMEM;
-        }
+    return ctx->watcher ? watcher_rearm(ctx->watcher, ctx) : 0;
+}
 
-        if (event.fflags & NOTE_EXTEND || event.fflags & NOTE_WRITE)
-            break;
+/* off is the offset of buf in the file */
+static void ktail_warn_cut(struct ktail_context *ctx)
+{
+    if (ctx->cut)
+        return;
+
+    warn("A line of '%s' is longer than %d MiB. Cutting it.", ctx->file,
+         STREAM_MAX_BYTES >> 20);
+    ctx->cut = 1;
+}
+
+static void ktail_line_append(struct ktail_context *ctx, const char *buf,
+                              size_t len, size_t off)
+{
+    if (!len)
+        return;
+    /* of an endless line of a pipe only the end is kept */
+    if (ctx->engine == KTAIL_ENGINE_STREAM &&
+        ctx->line_len + len > STREAM_MAX_BYTES) {
+        ktail_warn_cut(ctx);
+        ctx->line_len = 0;
     }
-#elif HAVE_INOTIFY
-    char buf[BUF_SIZE];
+    if (!ctx->line_len)
+        ctx->line_off = off;
 
-    while (42) {
-        struct inotify_event *event;
-        ssize_t rc;
+    if (ctx->line_len + len > ctx->line_cap) {
+        char *line;
 
-        rc = read(ctx->fd, buf, BUF_SIZE);
-        if (rc == -1 || rc == 0) {
-            if (errno == EINTR)
-                break;
-            print_err_errno("Failed to read from inotify fd");
-            return -EIO;
+        ctx->line_cap = ctx->line_cap ? ctx->line_cap : 256;
+        while (ctx->line_cap < ctx->line_len + len)
+            ctx->line_cap *= 2;
+        line = kmalloc(ctx->line_cap);
+        if (ctx->line_len)
+            memcpy(line, ctx->line, ctx->line_len);
+        kfree(ctx->line);
+        ctx->line = line;
+    }
+
+    memcpy(ctx->line + ctx->line_len, buf, len);
+    ctx->line_len += len;
+}
+
+typedef int (*ktail_line_fn)(struct ktail_context *ctx, const char *line,
+                             size_t len, size_t off, void *arg);
+
+/*
+ * Calls fn for each complete line in buf, which passes the filter. off is the
+ * offset of buf in the file. An incomplete last line is kept in ctx->line and
+ * continued by the next call.
+ */
+static int ktail_filter_lines(struct ktail_context *ctx, const char *buf,
+                              size_t len, size_t off, ktail_line_fn fn,
+                              void *arg)
+{
+    struct filter *filter = ctx->opts->filter;
+    const char *start = buf, *end = buf + len, *nl, *line;
+    size_t line_len;
+    int ret;
+
+    if (ctx->line_len) {
+        nl = scan_newline(buf, len);
+        if (!nl) {
+            ktail_line_append(ctx, buf, len, off);
+            return 0;
         }
 
-        event = (struct inotify_event *)buf;
-        if (event->mask & IN_MODIFY)
-            break;
+        ktail_line_append(ctx, buf, nl - buf + 1, off);
+        ret = filter_line(filter, ctx->line, ctx->line_len) ?
+            fn(ctx, ctx->line, ctx->line_len, ctx->line_off, arg) : 0;
+        ctx->line_len = 0;
+        if (ret)
+            return ret;
+        buf = nl + 1;
     }
-#else
-    while (42) {
-        struct stat buf;
 
-        if (stat(config.file, &buf)) {
-            print_err_errno("lstat() failed");
-            return -EIO;
-        }
+    /* whole lines end at the last newline */
+    nl = scan_newline_reverse(buf, end - buf);
+    if (!nl) {
+        ktail_line_append(ctx, buf, end - buf, off + (buf - start));
+        return 0;
+    }
 
-        if (buf.st_size > ctx->bytes)
-            break;
+    for (const char *p = buf;
+         (line = filter_find(filter, p, nl + 1 - p, &line_len));
+         p = line + line_len) {
+        ret = fn(ctx, line, line_len, off + (line - start), arg);
+        if (ret)
+            return ret;
+    }
 
-        /* zZz */
-        if (usleep(SLEEP_INTERVALL)) {
-            if (errno == EINTR)
-                break;
-            print_err_errno("usleep() failed");
-            return -EINTR;
-        }
+    ktail_line_append(ctx, nl + 1, end - nl - 1, off + (nl + 1 - start));
+
+    return 0;
+}
+
+/*
+ * Prints the incomplete last line of a file, which has been replaced or isn't
+ * followed.
+ */
+static int ktail_filter_pending(struct ktail_context *ctx)
+{
+    int ret = 0;
+
+    if (ctx->line_len &&
+        filter_line(ctx->opts->filter, ctx->line, ctx->line_len)) {
+        ret = ktail_print_header(ctx);
+        if (!ret)
+            ret = ktail_emit(ctx, ctx->line, ctx->line_len, ctx->line_off);
+    }
+    ctx->line_len = 0;
+
+    if (ret) {
+        errno = -ret;
+        print_err_errno("write() failed");
+        return -EIO;
     }
-#endif
 
     return 0;
 }
 
-void ktail_wait_close(struct ktail_context *ctx)
+static int ktail_switch(struct ktail_context *ctx)
 {
-    ASSERT_PARAM_NOT_NULL_VOID(ctx);
+    if (ktail_filter_pending(ctx))
+        return -EIO;
 
-#ifdef HAVE_KQUEUE
-    close(ctx->kq);
-    close(ctx->fd);
-#elif HAVE_INOTIFY
-    inotify_rm_watch(ctx->fd, ctx->wd);
-    close(ctx->fd);
-#endif
+    ctx->rotated = 0;
+    STATS_INC(ctx->opts->stats, rotations);
+    warn("File '%s' has been replaced, following the new file", ctx->file);
+
+    return ktail_reopen(ctx);
 }
 
-int ktail_open(struct ktail_context *ctx)
+/*
+ * Checks the opened file via fstat(). Only if the file didn't grow the path is
+ * looked up to detect whether it was replaced. With -F the path is checked on
+ * every wakeup, and a replaced file is drained before switching.
+ */
+static int ktail_stat(struct ktail_context *ctx)
 {
-    ASSERT_PARAM_NOT_NULL(ctx);
+    struct stats *stats = ctx->opts->stats;
+    struct stat sb;
 
-    if (!(ctx->f = fopen(config.file, "r"))) {
-        print_err_errno("fopen() failed");
+    STATS_INC(stats, syscalls);
+    if (fstat(ctx->fd, &sb)) {
+        print_err_errno("fstat() failed");
         return -EIO;
     }
+    ctx->size = sb.st_size;
+    ctx->rotated = 0;
 
-    return 0;
+    if (ctx->engine == KTAIL_ENGINE_STREAM)
+        return 0;
+
+    if (ctx->size < ctx->bytes) {
+        warn("File '%s' truncated", ctx->file);
+        STATS_INC(stats, truncations);
+        if (ctx->index)
+            lindex_invalidate(ctx->index);
+        ctx->bytes = 0;
+        ctx->line_len = 0;
+        return 0;
+    }
+
+    /* standard input has no path to look at */
+    if ((ctx->size > ctx->bytes && !ctx->opts->follow_name) || ctx->in_dir ||
+        ktail_is_stdin(ctx->file))
+        return 0;
+
+    STATS_INC(stats, syscalls);
+    if (stat(ctx->file, &sb))
+        return 0;
+    if (sb.st_dev == ctx->dev && sb.st_ino == ctx->ino)
+        return 0;
+
+    ctx->rotated = 1;
+
+    return ctx->size > ctx->bytes ? 0 : ktail_switch(ctx);
 }
 
-int ktail_reopen(struct ktail_context *ctx)
+void ktail_close(struct ktail_context *ctx)
 {
-    ASSERT_PARAM_NOT_NULL(ctx);
+    ASSERT_PARAM_NOT_NULL_VOID(ctx);
 
-    fclose(ctx->f);
+    ktail_close_file(ctx);
+}
 
-    if (!(ctx->f = fopen(config.file, "r"))) {
-        print_err_errno("fopen() failed");
-        return -EIO;
+/*
+ * Counts the lines in buf backwards. base is the offset of buf within a file of
+ * size bytes. Returns 1 and sets ctx->start once n lines have been seen.
+ */
+static int ktail_scan_backward(struct ktail_context *ctx, const char *buf,
+                               size_t len, size_t base, size_t size)
+{
+    size_t n = ctx->opts->n;
+
+    while (len > 0) {
+        size_t chunk = len > BLOCK_SIZE ? BLOCK_SIZE : len;
+        const char *start = buf + len - chunk;
+        const char *p;
+        size_t cnt;
+
+        /* skip whole chunks as long as they cannot contain the start */
+        cnt = count_newlines(start, chunk);
+        if (base + len == size && start[chunk - 1] == '\n')
+            cnt--;
+        if (ctx->line_counter + cnt < n) {
+            ctx->line_counter += cnt;
+            len -= chunk;
+            continue;
+        }
+
+        while ((p = scan_newline_reverse(buf, len))) {
+            size_t nl = base + (p - buf);
+
+            len = p - buf;
+
+            /* a trailing newline terminates the last line */
+            if (nl == size - 1)
+                continue;
+
+            if (++ctx->line_counter == n) {
+                ctx->start = nl + 1;
+                return 1;
+            }
+        }
     }
 
-    /* seek! */
-    if (fseek(ctx->f, ctx->bytes, SEEK_SET)) {
-        print_err_errno("fseek() failed");
-        return -EINVAL;
+    return 0;
+}
+
+/*
+ * Scans the file block by block backwards from EOF until n lines have been
+ * seen. Only the tail is touched, so the cost depends on the size of the
+ * output and not on the size of the file.
+ */
+static int ktail_read_backward(struct ktail_context *ctx)
+{
+    int fd = ctx->fd;
+    size_t size = ctx->size, pos = size;
+
+    ctx->start = 0;
+    ctx->bytes = size;
+    ctx->line_counter = 0;
+
+    while (pos > 0) {
+        size_t len = pos > BLOCK_SIZE ? BLOCK_SIZE : pos;
+        ssize_t rc;
+
+        pos -= len;
+        rc = pread_full(fd, ktail_buf(ctx), len, pos);
+        if (rc < 0) {
+            print_err_errno("pread() failed");
+            return -EIO;
+        }
+        if ((size_t)rc != len) {
+            print_err("File '%s' was truncated while reading", ctx->file);
+            return -EIO;
+        }
+
+        if (ktail_scan_backward(ctx, ctx->buf, len, pos, size))
+            return 0;
     }
 
+    /* the whole file is shorter than n lines */
+    if (size)
+        ctx->line_counter++;
+
     return 0;
 }
 
-void ktail_close(struct ktail_context *ctx)
+static int ktail_read_map(struct ktail_context *ctx)
 {
-    ASSERT_PARAM_NOT_NULL_VOID(ctx);
+    ctx->start = 0;
+    ctx->bytes = ctx->map_size;
+    ctx->line_counter = 0;
 
-    fclose(ctx->f);
+    if (ktail_scan_backward(ctx, ctx->map, ctx->map_size, 0, ctx->map_size))
+        return 0;
+
+    if (ctx->map_size)
+        ctx->line_counter++;
+
+    return 0;
 }
 
-int ktail_read(struct ktail_context *ctx)
+static int ktail_ring_line(struct ktail_context *ctx, const char *line,
+                           size_t len, size_t off, void *arg)
 {
-    size_t off = 0;
-    int c;
+    int eol = line[len - 1] == '\n';
 
-    ASSERT_PARAM_NOT_NULL(ctx);
+    (void)arg;
+
+    ring_push(ctx->ring, line, len, off, eol);
+    ctx->line_counter++;
+
+    return 0;
+}
+
+/*
+ * Only the last n matching lines are of interest. The mapping is filtered
+ * forward in chunks, starting at the end.
+ */
+static int ktail_read_map_filtered(struct ktail_context *ctx)
+{
+    struct filter *filter = ctx->opts->filter;
+    const char *map = ctx->map;
+    size_t end = ctx->map_size, n = ctx->opts->n, *lines = NULL, cap = 0;
+
+    ctx->start = 0;
+    ctx->bytes = ctx->map_size;
+    ctx->line_counter = 0;
 
-    while ((c = fgetc(ctx->f)) != EOF) {
-        ctx->bytes++;
+    while (end > 0) {
+        const char *nl, *line;
+        size_t begin = 0, len, nr = 0;
+
+        /* chunks start at a line */
+        if (end > FILTER_CHUNK_SIZE) {
+            nl = scan_newline_reverse(map, end - FILTER_CHUNK_SIZE);
+            begin = nl ? (size_t)(nl - map + 1) : 0;
+        }
 
-        /* length check */
-        if (off == (MAX_LINE - 1)) {
-            print_err("Length of line '%lu' is too long. Cutting it.",
-                      ctx->line_counter);
+        for (const char *p = map + begin;
+             (line = filter_find(filter, p, map + end - p, &len));
+             p = line + len) {
+            if (nr == cap) {
+                size_t *tmp;
 
-            /* read until eol */
-            while ((c = fgetc(ctx->f)) != EOF) {
-                ctx->bytes++;
-                if (c == '\n')
-                    break;
+                cap = cap ? cap * 2 : 1024;
+                tmp = kmalloc_array(cap, sizeof(*tmp));
+                if (nr)
+                    memcpy(tmp, lines, nr * sizeof(*tmp));
+                kfree(lines);
+                lines = tmp;
             }
-            if (ferror(ctx->f)) {
-                print_err_errno("fgetc() failed");
+            lines[nr++] = line - map;
+        }
+
+        if (ctx->line_counter + nr >= n) {
+            ctx->start = lines[nr - (n - ctx->line_counter)];
+            ctx->line_counter = n;
+            break;
+        }
+        ctx->line_counter += nr;
+        end = begin;
+    }
+
+    kfree(lines);
+
+    return 0;
+}
+
+/*
+ * Reads the next block. For pipes with -f only data, which arrives within
+ * timeout msec, is read, so a quiet writer doesn't block the other files.
+ * Returns its length, 0 at the end or -EAGAIN if nothing is pending.
+ */
+static ssize_t ktail_read_stream(struct ktail_context *ctx, char *buf,
+                                 int timeout)
+{
+    struct stats *stats = ctx->opts->stats;
+    struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+    int stream = ctx->engine == KTAIL_ENGINE_STREAM;
+    ssize_t rc;
+
+    while (42) {
+        if (stream && ctx->opts->follow) {
+            STATS_INC(stats, syscalls);
+            rc = poll(&pfd, 1, timeout);
+            if (rc < 0 && errno == EINTR)
+                continue;
+            if (rc < 0) {
+                print_err_errno("poll() failed");
                 return -EIO;
             }
+            if (!rc)
+                return -EAGAIN;
         }
 
-        if (c == '\n') {
-            ctx->data[idx(ctx->line_counter % config.n, off)] = '\0';
-            off = 0;
-            ctx->line_counter++;
+        STATS_INC(stats, syscalls);
+        rc = read(ctx->fd, buf, BLOCK_SIZE);
+        if (rc < 0 && errno == EINTR)
             continue;
+        if (rc < 0) {
+            print_err_errno("read() failed");
+            return -EIO;
         }
-        ctx->data[idx(ctx->line_counter % config.n, off++)] = c;
+        STATS_ADD(stats, bytes_read, rc);
+        if (!rc && stream)
+            ctx->eof = 1;
+
+        return rc;
     }
-    if (ferror(ctx->f)) {
-        print_err_errno("fgetc() failed");
-        return -EIO;
+}
+
+/* drops the part of buf, which is before the start of -n +K or -c +N */
+static size_t ktail_stream_skip(struct ktail_context *ctx, const char *buf,
+                                size_t len)
+{
+    const char *p = buf, *nl;
+
+    if (ctx->opts->bytes) {
+        size_t skip = ctx->skip < len ? ctx->skip : len;
+
+        ctx->skip -= skip;
+        return skip;
     }
 
-    /* deal with last line */
-    if (off != 0)
-        ctx->data[idx(ctx->line_counter % config.n, off)] = '\0';
+    while (ctx->skip && (nl = scan_newline(p, buf + len - p))) {
+        ctx->skip--;
+        p = nl + 1;
+    }
 
-    return 0;
+    return ctx->skip ? len : (size_t)(p - buf);
 }
 
-int ktail_read_and_print(struct ktail_context *ctx)
+/*
+ * Data read forward is collected in the ring. Pipes pass by only once, so
+ * their ring is bounded in bytes as well and -c N keeps the last N bytes.
+ */
+static struct line_ring *ktail_stream_ring(const struct ktail_context *ctx)
 {
-    int c;
+    const struct ktail_options *opts = ctx->opts;
 
-    ASSERT_PARAM_NOT_NULL(ctx);
+    if (opts->bytes)
+        return ring_init(opts->n ? SIZE_MAX : 0, opts->n);
+
+    return ring_init(opts->n,
+                     ctx->engine == KTAIL_ENGINE_STREAM ? STREAM_MAX_BYTES : 0);
+}
+
+static int ktail_read_forward(struct ktail_context *ctx)
+{
+    ssize_t rc;
+    size_t len;
+
+    if (!ctx->ring)
+        ctx->ring = ktail_stream_ring(ctx);
+    ktail_buf(ctx);
+
+    while ((rc = ktail_read_stream(ctx, ctx->buf, STREAM_SETTLE_MSEC)) != 0) {
+        const char *p = ctx->buf, *end;
+
+        if (rc == -EAGAIN)
+            break;
+        if (rc < 0)
+            return -EIO;
+        len = rc;
+        end = ctx->buf + len;
+
+        if (ktail_by_line(ctx)) {
+            ktail_filter_lines(ctx, p, len, ctx->bytes, ktail_ring_line, NULL);
+            ctx->bytes += len;
+            continue;
+        }
+
+        while (p < end) {
+            const char *nl = scan_newline(p, end - p);
+            size_t pos = ctx->bytes + (p - ctx->buf);
+
+            if (!nl) {
+                ring_push(ctx->ring, p, end - p, pos, 0);
+                break;
+            }
 
-    while ((c = fgetc(ctx->f)) != EOF) {
-        ctx->bytes++;
-        printf("%c", c);
+            ring_push(ctx->ring, p, nl - p + 1, pos, 1);
+            ctx->line_counter++;
+            p = nl + 1;
+        }
+        ctx->bytes += len;
     }
-    fflush(stdout);
-    if (ferror(ctx->f)) {
-        print_err_errno("fgetc() failed");
-        return -EIO;
+
+    /* without -f the unterminated last line is complete */
+    if (ctx->line_len && !ctx->opts->follow) {
+        if (filter_line(ctx->opts->filter, ctx->line, ctx->line_len))
+            ktail_ring_line(ctx, ctx->line, ctx->line_len, ctx->line_off, NULL);
+        ctx->line_len = 0;
     }
 
+    /* -c N cuts on purpose */
+    if (ctx->ring->cut && !ctx->opts->bytes)
+        ktail_warn_cut(ctx);
+
     return 0;
 }
 
-void ktail_print(const struct ktail_context *ctx)
+/* -c only needs the size, nothing is scanned */
+static int ktail_read_bytes(struct ktail_context *ctx)
 {
-    ASSERT_PARAM_NOT_NULL_VOID(ctx);
+    size_t size = ctx->size, n = ctx->opts->n;
 
-    const size_t lines = ctx->line_counter >= config.n ? config.n : ctx->line_counter;
-    const size_t start = ctx->line_counter >= config.n ? ctx->line_counter : 0;
+    if (ctx->opts->from_start)
+        ctx->start = n ? n - 1 : 0;
+    else
+        ctx->start = size > n ? size - n : 0;
+    if (ctx->start > size)
+        ctx->start = size;
+    ctx->bytes = size;
+
+    return 0;
+}
+
+/* -n +K, the start of line K is found by counting newlines on all cores */
+static int ktail_read_from_line(struct ktail_context *ctx)
+{
+    size_t n = ctx->opts->n;
+
+    if (pscan_line_offset(ctx->fd, ctx->map, ctx->size, n ? n - 1 : 0,
+                          &ctx->start)) {
+        print_err_errno("Failed to read '%s'", ctx->file);
+        return -EIO;
+    }
+    ctx->bytes = ctx->size;
 
-    for (size_t i = start; i < start + lines; ++i)
-        printf("%s\n", ctx->data + idx(i % config.n, 0));
-    fflush(stdout);
+    return 0;
+}
+
+/* with an index the start of the tail is looked up instead of scanned */
+static int ktail_read_index(struct ktail_context *ctx)
+{
+    size_t n = ctx->opts->n, line = n ? n - 1 : 0, nr_lines;
+
+    if (!ctx->opts->from_start) {
+        if (lindex_nr_lines(ctx->index, ctx, &nr_lines))
+            return -EIO;
+        line = nr_lines > n ? nr_lines - n : 0;
+    }
+
+    if (lindex_line_offset(ctx->index, ctx, line, &ctx->start))
+        return -EIO;
+    ctx->bytes = ctx->size;
+
+    return 0;
+}
+
+/* reads the file through the mapping, or a cached block of ctx->buf */
+struct ktail_cursor {
+    struct ktail_context *ctx;
+    size_t off, len;
+};
+
+/*
+ * Returns the data at off and sets len to the number of bytes available there,
+ * which are at least want unless EOF is closer.
+ */
+static const char *ktail_cursor_data(struct ktail_cursor *c, size_t off,
+                                     size_t want, size_t *len)
+{
+    struct ktail_context *ctx = c->ctx;
+    size_t size = ctx->size;
+    ssize_t rc;
+
+    if (want > size - off)
+        want = size - off;
+
+    if (ctx->map && size <= ctx->map_size) {
+        *len = size - off;
+        return ctx->map + off;
+    }
+
+    if (off < c->off || off + want > c->off + c->len) {
+        rc = pread_full(ctx->fd, ktail_buf(ctx),
+                        size - off > BLOCK_SIZE ? BLOCK_SIZE : size - off, off);
+        if (rc < 0) {
+            print_err_errno("pread() failed");
+            return NULL;
+        }
+        if ((size_t)rc < want) {
+            print_err("File '%s' was truncated while reading", ctx->file);
+            return NULL;
+        }
+        c->off = off;
+        c->len = rc;
+    }
+    *len = c->off + c->len - off;
+
+    return ctx->buf + (off - c->off);
+}
+
+/* the first line, which starts at pos or later */
+static int ktail_line_start(struct ktail_cursor *c, size_t pos, size_t *start)
+{
+    size_t size = c->ctx->size;
+
+    if (!pos) {
+        *start = 0;
+        return 0;
+    }
+
+    /* pos is a line start if a newline precedes it */
+    for (pos--; pos < size;) {
+        const char *data, *nl;
+        size_t len;
+
+        data = ktail_cursor_data(c, pos, 1, &len);
+        if (!data)
+            return -EIO;
+
+        nl = scan_newline(data, len);
+        if (nl) {
+            *start = pos + (nl - data) + 1;
+            return 0;
+        }
+        pos += len;
+    }
+    *start = size;
+
+    return 0;
+}
+
+/*
+ * Finds the first line from pos on, which starts before limit and carries a
+ * timestamp. Returns 1 if found, 0 if not.
+ */
+static int ktail_next_stamp(struct ktail_cursor *c, size_t pos, size_t limit,
+                            size_t *line, time_t *t)
+{
+    while (pos < limit && pos < c->ctx->size) {
+        const char *data;
+        size_t len;
+
+        data = ktail_cursor_data(c, pos, TSTAMP_MAX_LEN, &len);
+        if (!data)
+            return -EIO;
+        if (!tstamp_parse(data, len > TSTAMP_MAX_LEN ? TSTAMP_MAX_LEN : len, t)) {
+            *line = pos;
+            return 1;
+        }
+
+        /* continuation lines belong to the previous entry */
+        if (ktail_line_start(c, pos + 1, &pos))
+            return -EIO;
+    }
+
+    return 0;
+}
+
+/*
+ * Bisects the file for the first line stamped at t or later (after t if after
+ * is set). Only O(log size) lines are parsed until the range fits into one
+ * block, which is scanned line by line.
+ */
+static int ktail_bisect_time(struct ktail_cursor *c, time_t t, int after,
+                             size_t *offset)
+{
+    size_t lo = 0, hi = c->ctx->size, pos, line;
+    time_t ts;
+    int rc;
+
+    while (hi - lo > BLOCK_SIZE) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (ktail_line_start(c, mid, &pos))
+            return -EIO;
+        rc = ktail_next_stamp(c, pos, hi, &line, &ts);
+        if (rc < 0)
+            return -EIO;
+
+        if (!rc || (after ? ts > t : ts >= t))
+            hi = mid;
+        else
+            lo = line;
+    }
+
+    for (pos = lo; (rc = ktail_next_stamp(c, pos, c->ctx->size, &line, &ts)) > 0;) {
+        if (after ? ts > t : ts >= t) {
+            *offset = line;
+            return 0;
+        }
+        if (ktail_line_start(c, line + 1, &pos))
+            return -EIO;
+    }
+    if (rc < 0)
+        return -EIO;
+    *offset = c->ctx->size;
+
+    return 0;
+}
+
+/* --since/--until, the range between both is printed */
+static int ktail_read_time(struct ktail_context *ctx)
+{
+    const struct ktail_options *opts = ctx->opts;
+    struct ktail_cursor c = { .ctx = ctx };
+
+    ctx->start = 0;
+    ctx->bytes = ctx->size;
+
+    if (opts->has_since && ktail_bisect_time(&c, opts->since, 0, &ctx->start))
+        return -EIO;
+    if (opts->has_until && ktail_bisect_time(&c, opts->until, 1, &ctx->bytes))
+        return -EIO;
+    if (ctx->bytes < ctx->start)
+        ctx->bytes = ctx->start;
+
+    return 0;
+}
+
+int ktail_read(struct ktail_context *ctx)
+{
+    const struct ktail_options *opts;
+
+    ASSERT_PARAM_NOT_NULL(ctx);
+
+    opts = ctx->opts;
+    /* pipes cannot seek, ktail_print() drops the data before the start */
+    if (opts->from_start && ctx->engine == KTAIL_ENGINE_STREAM) {
+        ctx->skip = opts->n ? opts->n - 1 : 0;
+        return 0;
+    }
+    if (opts->bytes && ctx->engine != KTAIL_ENGINE_STREAM)
+        return ktail_read_bytes(ctx);
+    if ((opts->has_since || opts->has_until) &&
+        ctx->engine == KTAIL_ENGINE_STREAM) {
+        print_err("Time ranges cannot be searched in the pipe '%s'", ctx->file);
+        return -EIO;
+    }
+    if (opts->has_since || opts->has_until)
+        return ktail_read_time(ctx);
+    if (ctx->index && !opts->filter)
+        return ktail_read_index(ctx);
+    if (opts->from_start)
+        return ktail_read_from_line(ctx);
+
+    /* filtering needs whole lines, which are read forward without a mapping */
+    if (opts->filter)
+        return ctx->engine == KTAIL_ENGINE_MMAP ?
+            ktail_read_map_filtered(ctx) : ktail_read_forward(ctx);
+
+    switch (ctx->engine) {
+    case KTAIL_ENGINE_MMAP:
+        return ktail_read_map(ctx);
+    case KTAIL_ENGINE_PREAD:
+        return ktail_read_backward(ctx);
+    default:
+        return ktail_read_forward(ctx);
+    }
+}
+
+static int ktail_read_and_print_map(struct ktail_context *ctx)
+{
+    int ret = ktail_remap(ctx);
+
+    if (ret) {
+        /* continue with the buffered path */
+        errno = -ret;
+        warn_errno("mmap() failed, falling back to read()");
+        ctx->engine = KTAIL_ENGINE_PREAD;
+        return ktail_read_and_print(ctx);
+    }
+
+    if (ctx->map_size <= ctx->bytes)
+        return 0;
+
+    ret = ktail_print_header(ctx);
+    if (!ret)
+        ret = ktail_emit(ctx, ctx->map + ctx->bytes,
+                         ctx->map_size - ctx->bytes, ctx->bytes);
+    if (ret) {
+        errno = -ret;
+        print_err_errno("write() failed");
+        return -EIO;
+    }
+    ctx->bytes = ctx->map_size;
+
+    return 0;
+}
+
+static int ktail_read_and_print_stream(struct ktail_context *ctx)
+{
+    char *buf = ktail_buf(ctx);
+    size_t skip;
+    ssize_t rc;
+    int ret;
+
+    while ((rc = ktail_read_stream(ctx, buf, 0)) != 0) {
+        if (rc == -EAGAIN)
+            break;
+        if (rc < 0)
+            return -EIO;
+        skip = ktail_stream_skip(ctx, buf, rc);
+        ctx->bytes += skip;
+        if ((size_t)rc == skip)
+            continue;
+
+        ret = ktail_print_header(ctx);
+        if (!ret)
+            ret = ktail_emit(ctx, buf + skip, rc - skip, ctx->bytes);
+        if (ret) {
+            errno = -ret;
+            print_err_errno("write() failed");
+            return -EIO;
+        }
+        ctx->bytes += rc - skip;
+    }
+
+    return 0;
+}
+
+static int ktail_emit_line(struct ktail_context *ctx, const char *line,
+                           size_t len, size_t off, void *arg)
+{
+    (void)arg;
+
+    return ktail_emit(ctx, line, len, off);
+}
+
+/*
+ * Passes the range [start, end) of the file to the output. Fds get it moved in
+ * the kernel, callbacks get slices of the mapping or of ctx->buf. Returns the
+ * number of bytes passed, which is less at EOF, or a negative error code.
+ */
+static ssize_t ktail_emit_range(struct ktail_context *ctx, size_t start,
+                                size_t end)
+{
+    struct output *out = ctx->opts->output;
+    struct stats *stats = ctx->opts->stats;
+    size_t pos = start;
+    int ret;
+
+    if (!out->fn)
+        return output_transfer(out, ctx->fd, start, end - start);
+
+    while (pos < end) {
+        const char *data;
+        size_t len = end - pos;
+
+        if (ctx->map && end <= ctx->map_size) {
+            data = ctx->map + pos;
+        } else {
+            ssize_t rc = pread_full(ctx->fd, ktail_buf(ctx),
+                                    len > BLOCK_SIZE ? BLOCK_SIZE : len, pos);
+
+            STATS_INC(stats, syscalls);
+            if (rc < 0)
+                return -errno;
+            if (rc == 0)
+                break;
+            STATS_ADD(stats, bytes_read, rc);
+            data = ctx->buf;
+            len = rc;
+        }
+
+        /* lines may span the blocks, they're put together in ctx->line */
+        ret = out->lines ?
+            ktail_filter_lines(ctx, data, len, pos, ktail_emit_line, NULL) :
+            ktail_emit(ctx, data, len, pos);
+        if (ret)
+            return ret;
+        pos += len;
+    }
+
+    return pos - start;
+}
+
+/* moves the range [ctx->bytes, end) to the output */
+static int ktail_transfer(struct ktail_context *ctx, size_t end)
+{
+    ssize_t rc;
+
+    if (end <= ctx->bytes)
+        return 0;
+
+    if (ktail_print_header(ctx)) {
+        print_err_errno("write() failed");
+        return -EIO;
+    }
+
+    rc = ktail_emit_range(ctx, ctx->bytes, end);
+    if (rc < 0) {
+        errno = -rc;
+        print_err_errno("Failed to print '%s'", ctx->file);
+        return -EIO;
+    }
+    ctx->bytes += rc;
+
+    return 0;
+}
+
+static int ktail_vec_line(struct ktail_context *ctx, const char *line,
+                          size_t len, size_t off, void *arg)
+{
+    struct output *out = ctx->opts->output;
+    struct output_vec *vec = arg;
+    int ret;
+
+    ret = ktail_print_header(ctx);
+    if (ret)
+        return ret;
+
+    /* ctx->line is reused for the next line, so it's written right away */
+    if (out->fn || line == ctx->line) {
+        ret = output_vec_flush(out, vec);
+        return ret ? ret : ktail_emit(ctx, line, len, off);
+    }
+
+    return output_vec_add(out, vec, line, len);
+}
+
+/* off is the offset of buf in the file */
+static int ktail_filter_block(struct ktail_context *ctx, const char *buf,
+                              size_t len, size_t off)
+{
+    struct output_vec vec = { .cnt = 0 };
+    int ret;
+
+    ret = ktail_filter_lines(ctx, buf, len, off, ktail_vec_line, &vec);
+    if (!ret)
+        ret = output_vec_flush(ctx->opts->output, &vec);
+    if (ret) {
+        errno = -ret;
+        print_err_errno("write() failed");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+static int ktail_filter_range(struct ktail_context *ctx)
+{
+    struct stats *stats = ctx->opts->stats;
+    char *buf = ktail_buf(ctx);
+
+    while (ctx->bytes < ctx->size) {
+        size_t len = ctx->size - ctx->bytes;
+        ssize_t rc;
+
+        rc = pread_full(ctx->fd, buf, len > BLOCK_SIZE ? BLOCK_SIZE : len,
+                        ctx->bytes);
+        STATS_INC(stats, syscalls);
+        if (rc < 0) {
+            print_err_errno("pread() failed");
+            return -EIO;
+        }
+        if (rc == 0)
+            break;
+        STATS_ADD(stats, bytes_read, rc);
+
+        ctx->bytes += rc;
+        if (ktail_filter_block(ctx, buf, rc, ctx->bytes - rc))
+            return -EIO;
+    }
+
+    return 0;
+}
+
+/* new data cannot be transferred as a whole, it's passed line by line */
+static int ktail_read_and_print_filtered(struct ktail_context *ctx)
+{
+    char *buf = ktail_buf(ctx);
+    ssize_t rc;
+
+    if (ctx->engine == KTAIL_ENGINE_STREAM) {
+        while ((rc = ktail_read_stream(ctx, buf, 0)) != 0) {
+            size_t skip;
+
+            if (rc == -EAGAIN)
+                break;
+            if (rc < 0)
+                return -EIO;
+            skip = ktail_stream_skip(ctx, buf, rc);
+            ctx->bytes += rc;
+            if (ktail_filter_block(ctx, buf + skip, rc - skip,
+                                   ctx->bytes - rc + skip))
+                return -EIO;
+        }
+        /* the writers are gone, so the last line is complete */
+        return ctx->eof && ktail_filter_pending(ctx) ? -EIO : 0;
+    }
+
+    if (ktail_stat(ctx))
+        return -EIO;
+
+    if (ktail_filter_range(ctx))
+        return -EIO;
+
+    if (!ctx->rotated)
+        return 0;
+    if (ktail_switch(ctx))
+        return -EIO;
+
+    return ktail_filter_range(ctx);
+}
+
+static int ktail_print_new(struct ktail_context *ctx)
+{
+    /* without zero copy the mapping saves the extra copy of read() */
+    if (ctx->engine == KTAIL_ENGINE_MMAP &&
+        !output_zero_copy(ctx->opts->output))
+        return ktail_read_and_print_map(ctx);
+
+    return ktail_transfer(ctx, ctx->size);
+}
+
+int ktail_read_and_print(struct ktail_context *ctx)
+{
+    ASSERT_PARAM_NOT_NULL(ctx);
+
+    if (ktail_by_line(ctx))
+        return ktail_read_and_print_filtered(ctx);
+
+    if (ctx->engine == KTAIL_ENGINE_STREAM)
+        return ktail_read_and_print_stream(ctx);
+
+    if (ktail_stat(ctx))
+        return -EIO;
+
+    if (ktail_print_new(ctx))
+        return -EIO;
+
+    /* the rest of the old file is printed, continue with the new one */
+    if (!ctx->rotated)
+        return 0;
+    if (ktail_switch(ctx))
+        return -EIO;
+
+    return ktail_print_new(ctx);
+}
+
+static int ktail_print_range(struct ktail_context *ctx)
+{
+    ssize_t rc;
+
+    if (ctx->bytes <= ctx->start)
+        return 0;
+
+    rc = ktail_emit_range(ctx, ctx->start, ctx->bytes);
+    if (rc < 0) {
+        errno = -rc;
+        print_err_errno("Failed to print '%s'", ctx->file);
+        return -EIO;
+    }
+
+    /* without -f the unterminated last line is complete */
+    return ctx->opts->follow ? 0 : ktail_filter_pending(ctx);
+}
+
+int ktail_next_line(const struct ktail_context *ctx, size_t *pos,
+                    struct ktail_line *line)
+{
+    const char *begin, *nl;
+    size_t left;
+
+    ASSERT_PARAM_NOT_NULL(ctx);
+    ASSERT_PARAM_NOT_NULL(pos);
+    ASSERT_PARAM_NOT_NULL(line);
+
+    if (ctx->engine != KTAIL_ENGINE_MMAP || *pos >= ctx->bytes)
+        return 0;
+
+    begin = ctx->map + *pos;
+    left = ctx->bytes - *pos;
+    nl = scan_newline(begin, left);
+
+    line->ptr = begin;
+    line->len = nl ? (size_t)(nl - begin + 1) : left;
+    line->offset = *pos;
+    *pos += line->len;
+
+    return 1;
+}
+
+/* slices are contiguous, so a line wrapping around the ring is copied */
+static int ktail_emit_ring_line(struct ktail_context *ctx,
+                                const struct iovec *iov, int cnt, size_t pos)
+{
+    size_t len;
+    char *line;
+    int ret;
+
+    if (cnt == 1)
+        return ktail_emit(ctx, iov[0].iov_base, iov[0].iov_len, pos);
+
+    len = iov[0].iov_len + iov[1].iov_len;
+    line = kmalloc(len);
+    memcpy(line, iov[0].iov_base, iov[0].iov_len);
+    memcpy(line + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+    ret = ktail_emit(ctx, line, len, pos);
+    kfree(line);
+
+    return ret;
+}
+
+/* the lines are packed in the ring, so most of them merge into few iovecs */
+static int ktail_print_ring(struct ktail_context *ctx)
+{
+    struct output *out = ctx->opts->output;
+    struct output_vec vec = { .cnt = 0 };
+    int ret = 0;
+
+    for (size_t i = 0; !ret && i < ctx->ring->nr; ++i) {
+        struct iovec iov[2];
+        size_t pos;
+        int cnt = ring_line(ctx->ring, i, iov, &pos);
+
+        if (out->fn) {
+            ret = ktail_emit_ring_line(ctx, iov, cnt, pos);
+            continue;
+        }
+        for (int j = 0; !ret && j < cnt; ++j)
+            ret = output_vec_add(out, &vec, iov[j].iov_base, iov[j].iov_len);
+    }
+
+    return ret ? ret : output_vec_flush(out, &vec);
+}
+
+static int ktail_print_map_filtered(struct ktail_context *ctx)
+{
+    struct output *out = ctx->opts->output;
+    struct output_vec vec = { .cnt = 0 };
+    const char *p = ctx->map + ctx->start, *end = ctx->map + ctx->bytes;
+    const char *line;
+    size_t len;
+    int ret = 0;
+
+    while (!ret &&
+           (line = filter_find(ctx->opts->filter, p, end - p, &len))) {
+        ret = out->fn ? ktail_emit(ctx, line, len, line - ctx->map) :
+            output_vec_add(out, &vec, line, len);
+        p = line + len;
+    }
+
+    return ret ? ret : output_vec_flush(out, &vec);
+}
+
+int ktail_print(struct ktail_context *ctx)
+{
+    const struct ktail_options *opts;
+    int ret;
+
+    ASSERT_PARAM_NOT_NULL(ctx);
+
+    opts = ctx->opts;
+    if (ktail_print_header(ctx)) {
+        print_err_errno("write() failed");
+        return -EIO;
+    }
+
+    /* everything after the start of a pipe is passed through */
+    if (opts->from_start && ctx->engine == KTAIL_ENGINE_STREAM)
+        return ktail_read_and_print(ctx);
+
+    /* byte ranges take the zero copy path of the follow mode */
+    if ((opts->bytes || opts->from_start || opts->has_since ||
+         opts->has_until) &&
+        ctx->engine != KTAIL_ENGINE_STREAM)
+        return ktail_print_range(ctx);
+
+    /* filtered lines have been collected in the ring, unless mapped */
+    if (opts->filter && ctx->engine == KTAIL_ENGINE_MMAP)
+        ret = ktail_print_map_filtered(ctx);
+    else if (opts->filter || ctx->engine == KTAIL_ENGINE_STREAM)
+        ret = ktail_print_ring(ctx);
+    else if (ctx->engine == KTAIL_ENGINE_PREAD || opts->output->fn)
+        return ktail_print_range(ctx);
+    else
+        /* the tail is one contiguous range of the mapping */
+        ret = output_write(opts->output, ctx->map + ctx->start,
+                           ctx->bytes - ctx->start);
+
+    if (ret) {
+        errno = -ret;
+        print_err_errno("write() failed");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+struct ktail_follower {
+    const struct ktail_options *opts;
+    struct watcher *w;
+    /* --dir directories */
+    struct ktail_dir **dirs;
+    size_t nr_dirs;
+    volatile sig_atomic_t stop;
+    struct uring *ring;
+    /* buffers of the io_uring path */
+    char *uring_bufs;
+    char (*uring_headers)[HEADER_SIZE];
+};
+
+#ifdef HAVE_IO_URING
+enum uring_op_type {
+    URING_OP_HEADER,
+    URING_OP_READ,
+    URING_OP_WRITE,
+};
+
+struct uring_op {
+    struct ktail_context *ctx;
+    enum uring_op_type type;
+    size_t len;
+    int32_t res;
+};
+
+/*
+ * Submits the queued chain and waits for it. A failed or short operation
+ * cancels the rest of the chain. The affected files are completed with the
+ * synchronous path.
+ */
+static int ktail_uring_flush(struct ktail_follower *f, struct uring_op *ops,
+                             size_t nr_ops)
+{
+    struct ktail_context *fallback[URING_BUFS];
+    size_t nr_fallback = 0;
+    uint64_t user_data;
+    int32_t res;
+    int failed = 0, ret;
+
+    ret = uring_submit_and_wait(f->ring);
+    if (ret) {
+        errno = -ret;
+        print_err_errno("io_uring_enter() failed");
+        return -EIO;
+    }
+    while (!uring_reap(f->ring, &user_data, &res))
+        if (user_data < nr_ops)
+            ops[user_data].res = res;
+
+    for (size_t i = 0; i < nr_ops; ++i) {
+        struct uring_op *op = &ops[i];
+        struct stats *stats = op->ctx->opts->stats;
+
+        if (!failed) {
+            if (op->type == URING_OP_WRITE && op->res > 0)
+                op->ctx->bytes += op->res;
+            if (op->res > 0 && op->type == URING_OP_READ)
+                STATS_ADD(stats, bytes_read, op->res);
+            else if (op->res > 0)
+                STATS_ADD(stats, bytes_written, op->res);
+            failed = op->res < 0 || (size_t)op->res != op->len;
+            /*
+             * The header of the file, which failed, is out unless its header
+             * failed. Then the header before is the last one written.
+             */
+            if (failed && op->type != URING_OP_HEADER)
+                op->ctx->opts->output->last_header = op->ctx;
+            else if (failed)
+                op->ctx->opts->output->last_header = i ? ops[i - 1].ctx : NULL;
+        }
+        if (failed && (!nr_fallback || fallback[nr_fallback - 1] != op->ctx))
+            fallback[nr_fallback++] = op->ctx;
+    }
+
+    for (size_t i = 0; i < nr_fallback; ++i)
+        if (ktail_read_and_print(fallback[i]))
+            return -EIO;
+
+    return 0;
+}
+
+static int ktail_read_and_print_uring(struct ktail_follower *f,
+                                      struct ktail_context **ctxs, size_t nr)
+{
+    struct uring_op ops[3 * URING_BUFS];
+    size_t nr_ops = 0, nr_bufs = 0, nr_headers = 0;
+    struct uring *ring = f->ring;
+
+    if (!f->uring_bufs) {
+        f->uring_bufs = kmalloc_array(URING_BUFS, BLOCK_SIZE);
+        f->uring_headers = kmalloc_array(URING_BUFS, HEADER_SIZE);
+    }
+
+    for (size_t i = 0; i < nr; ++i) {
+        struct ktail_context *ctx = ctxs[i];
+        int out_fd = ctx->opts->output->fd;
+        size_t pos;
+
+        /* streams, filtered lines and callbacks take the synchronous path */
+        if (ctx->engine == KTAIL_ENGINE_STREAM || ctx->opts->filter ||
+            ctx->opts->output->fn) {
+            if (ktail_uring_flush(f, ops, nr_ops))
+                return -EIO;
+            nr_ops = nr_bufs = nr_headers = 0;
+            if (ktail_read_and_print(ctx))
+                return -EIO;
+            continue;
+        }
+
+        if (ktail_stat(ctx))
+            return -EIO;
+
+        pos = ctx->bytes;
+        while (pos < ctx->size) {
+            size_t len;
+            char *buf;
+
+            if (nr_bufs == URING_BUFS || uring_space(ring) < 3) {
+                if (ktail_uring_flush(f, ops, nr_ops))
+                    return -EIO;
+                nr_ops = nr_bufs = nr_headers = 0;
+                pos = ctx->bytes;
+                continue;
+            }
+
+            /* header, read and write are executed in order */
+            len = ktail_format_header(ctx, f->uring_headers[nr_headers],
+                                      HEADER_SIZE);
+            if (len) {
+                uring_prep_write(ring, out_fd, f->uring_headers[nr_headers++],
+                                 len, (uint64_t)-1, nr_ops, 1);
+                ops[nr_ops++] = (struct uring_op){ ctx, URING_OP_HEADER, len, 0 };
+            }
+
+            len = ctx->size - pos > BLOCK_SIZE ? BLOCK_SIZE : ctx->size - pos;
+            buf = f->uring_bufs + nr_bufs++ * BLOCK_SIZE;
+            uring_prep_read(ring, ctx->fd, buf, len, pos, nr_ops, 1);
+            ops[nr_ops++] = (struct uring_op){ ctx, URING_OP_READ, len, 0 };
+            uring_prep_write(ring, out_fd, buf, len, (uint64_t)-1, nr_ops, 1);
+            ops[nr_ops++] = (struct uring_op){ ctx, URING_OP_WRITE, len, 0 };
+            pos += len;
+        }
+    }
+
+    if (ktail_uring_flush(f, ops, nr_ops))
+        return -EIO;
+
+    /* replaced files have been drained, switch to the new ones */
+    for (size_t i = 0; i < nr; ++i)
+        if (ctxs[i]->rotated && ktail_read_and_print(ctxs[i]))
+            return -EIO;
+
+    return 0;
+}
+#endif
+
+static struct uring *ktail_uring_init(const struct ktail_options *opts)
+{
+#ifdef HAVE_IO_URING
+    struct uring *ring = uring_init(URING_ENTRIES, opts->stats);
+
+    if (!ring)
+        warn_errno("io_uring is not available, using read/write");
+
+    return ring;
+#else
+    (void)opts;
+    warn("io_uring support is not compiled in, using read/write");
+
+    return NULL;
+#endif
+}
+
+static int ktail_print_batch(struct ktail_follower *f,
+                             struct ktail_context **ctxs, size_t nr)
+{
+#ifdef HAVE_IO_URING
+    if (f->ring)
+        return ktail_read_and_print_uring(f, ctxs, nr);
+#else
+    (void)f;
+#endif
+
+    for (size_t i = 0; i < nr; ++i)
+        if (ktail_read_and_print(ctxs[i]))
+            return -EIO;
+
+    return 0;
+}
+
+static int ktail_follower_print(struct ktail_follower *f,
+                                struct ktail_context **ctxs, size_t nr)
+{
+    struct stats *stats = f->opts->stats;
+
+    if (stats && stats->stamps)
+        for (size_t i = 0; i < nr; ++i)
+            ctxs[i]->stamp_off = ctxs[i]->bytes;
+
+    if (ktail_print_batch(f, ctxs, nr))
+        return -EIO;
+
+    /* the age of the first new line of every file */
+    if (stats && stats->stamps)
+        for (size_t i = 0; i < nr; ++i)
+            if (ctxs[i]->engine != KTAIL_ENGINE_STREAM &&
+                ctxs[i]->bytes > ctxs[i]->stamp_off)
+                stats_stamp(stats, ctxs[i], ctxs[i]->stamp_off);
+
+    /* the index is extended by the printed data, which is still cached */
+    for (size_t i = 0; i < nr; ++i)
+        if (ctxs[i]->index &&
+            lindex_update(ctxs[i]->index, ctxs[i], ctxs[i]->bytes))
+            return -EIO;
+
+    return 0;
+}
+
+struct ktail_follower *ktail_follower_init(const struct ktail_options *opts)
+{
+    struct ktail_follower *f = kzmalloc(sizeof(*f));
+
+    f->opts = opts;
+    f->w = watcher_init(opts);
+    if (!f->w) {
+        kfree(f);
+        return NULL;
+    }
+
+    /* the linked writes go to an fd */
+    if (opts->io_uring && !opts->output->fn)
+        f->ring = ktail_uring_init(opts);
+
+    return f;
+}
+
+int ktail_follower_add(struct ktail_follower *f, struct ktail_context *ctx)
+{
+    ASSERT_PARAM_NOT_NULL(f);
+    ASSERT_PARAM_NOT_NULL(ctx);
+
+    /* a pipe, which already ended, has nothing more to print */
+    if (ctx->eof)
+        return 0;
+
+    return watcher_add(f->w, ctx);
+}
+
+void ktail_follower_remove(struct ktail_follower *f, struct ktail_context *ctx)
+{
+    ASSERT_PARAM_NOT_NULL_VOID(f);
+    ASSERT_PARAM_NOT_NULL_VOID(ctx);
+
+    if (ctx->watcher == f->w)
+        watcher_remove(f->w, ctx);
+}
+
+int ktail_follower_add_dir(struct ktail_follower *f, const char *path,
+                           const char *pattern, ktail_dir_fn fn, void *arg)
+{
+    struct ktail_dir *dir, **dirs;
+
+    ASSERT_PARAM_NOT_NULL(f);
+    ASSERT_PARAM_NOT_NULL(path);
+
+    /* watched before it's read, so that no entry is missed */
+    dir = dir_init(f, f->opts, path, pattern, fn, arg);
+    if (watcher_add_dir(f->w, &dir->watch)) {
+        dir_free(dir);
+        return -EIO;
+    }
+
+    dirs = kmalloc_array(f->nr_dirs + 1, sizeof(*dirs));
+    if (f->nr_dirs)
+        memcpy(dirs, f->dirs, f->nr_dirs * sizeof(*dirs));
+    kfree(f->dirs);
+    f->dirs = dirs;
+    f->dirs[f->nr_dirs++] = dir;
+
+    return dir_scan(dir);
+}
+
+int ktail_follower_step(struct ktail_follower *f)
+{
+    struct stats *stats;
+    unsigned long long start, woken, flushed;
+    int rc;
+
+    ASSERT_PARAM_NOT_NULL(f);
+
+    if (f->stop || (!f->w->nr && !f->nr_dirs))
+        return WAIT_STOP;
+
+    stats = f->opts->stats;
+    start = stats_now(stats);
+    rc = watcher_wait(f->w);
+    if (rc)
+        return rc;
+    if (f->stop)
+        return WAIT_STOP;
+
+    woken = stats_now(stats);
+    STATS_ADD(stats, wait_ns, woken - start);
+    STATS_INC(stats, wakeups);
+
+    /* new files are printed, removed ones leave the ready list */
+    for (size_t i = 0; i < f->nr_dirs; ++i)
+        if (f->dirs[i]->watch.ready && dir_update(f->dirs[i]))
+            return -EIO;
+
+    if (ktail_follower_print(f, f->w->ready, f->w->nr_ready))
+        return -EIO;
+
+    if (stats && f->w->nr_ready) {
+        flushed = stats_now(stats);
+        STATS_ADD(stats, print_ns, flushed - woken);
+        stats_hist_add(stats->flush_hist, flushed - woken);
+    }
+
+    /* pipes, whose writers are gone, are done; removed entries are swapped */
+    for (size_t i = f->w->nr_ready; i-- > 0;)
+        if (f->w->ready[i]->eof)
+            watcher_remove(f->w, f->w->ready[i]);
+
+    return 0;
+}
+
+void ktail_follower_timeout(struct ktail_follower *f, int msec)
+{
+    ASSERT_PARAM_NOT_NULL_VOID(f);
+
+    f->w->timeout = msec;
+}
+
+void ktail_follower_stop(struct ktail_follower *f)
+{
+    ASSERT_PARAM_NOT_NULL_VOID(f);
+
+    f->stop = 1;
+}
+
+int ktail_follower_fd(const struct ktail_follower *f)
+{
+    ASSERT_PARAM_NOT_NULL(f);
+
+    return watcher_fd(f->w);
+}
+
+void ktail_follower_free(struct ktail_follower *f)
+{
+    if (!f)
+        return;
+
+#ifdef HAVE_IO_URING
+    if (f->ring)
+        uring_free(f->ring);
+#endif
+    watcher_close(f->w);
+    for (size_t i = 0; i < f->nr_dirs; ++i)
+        dir_free(f->dirs[i]);
+    kfree(f->dirs);
+    kfree(f->uring_bufs);
+    kfree(f->uring_headers);
+    kfree(f);
 }
@@ -23,41 +23,167 @@
 #include "ktail_config.h"
 
 #include <stddef.h>
-#ifdef HAVE_KQUEUE
+#include <time.h>
 #include <sys/types.h>
-#include <sys/event.h>
-#elif HAVE_INOTIFY
-#include <sys/inotify.h>
-#endif
+
+#include "output.h"
+#include "wait.h"
+
+struct filter;
+struct line_index;
+struct stats;
+
+/*
+ * Options of the contexts, which keep a pointer to them. They may be shared by
+ * any number of contexts and have to outlive them.
+ */
+struct ktail_options {
+    size_t n;                   /* lines, or bytes if bytes is set */
+    int bytes;                  /* -c: n counts bytes instead of lines */
+    int from_start;             /* +n: n counts from the beginning */
+    time_t since;               /* --since, if has_since is set */
+    time_t until;               /* --until, if has_until is set */
+    int has_since;
+    int has_until;
+    int follow;                 /* the files are followed after the tail */
+    int follow_name;
+    unsigned long coalesce;     /* usec */
+    const char *backend;        /* wait backend, NULL for the default one */
+    unsigned long poll_min;     /* usec */
+    unsigned long poll_max;     /* usec */
+    int headers;                /* "==> file <==", only written to fds */
+    int io_uring;
+    int index;                  /* keep a sidecar line index */
+    int signals;                /* SIGINT/SIGTERM stop the epoll backend */
+    struct filter *filter;      /* --match/--exclude, or NULL */
+    struct stats *stats;        /* counters, or NULL */
+    struct output *output;      /* destination of the data */
+};
+
+enum ktail_engine {
+    KTAIL_ENGINE_STREAM,        /* read forward with stdio */
+    KTAIL_ENGINE_PREAD,         /* read backwards in blocks */
+    KTAIL_ENGINE_MMAP,          /* scan the mapping */
+};
+
+/* slice of a line or file, points into the mapping or a buffer */
+struct ktail_line {
+    const char *ptr;
+    size_t len;
+    size_t offset;
+};
 
 struct ktail_context {
-    FILE *f;
-    char *data;
+    const char *file;
+    const struct ktail_options *opts;
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    size_t size;
+    struct line_ring *ring;
+    char *buf;
+    char *map;
+    size_t map_size;
+    /* incomplete last line, which cannot be filtered yet, and its offset */
+    char *line;
+    size_t line_len, line_cap, line_off;
+    /* sparse line index, with --index */
+    struct line_index *index;
     size_t line_counter;
     size_t bytes;
-#ifdef HAVE_KQUEUE
-    int fd;
-    int kq;
-    struct kevent change;
-#elif HAVE_INOTIFY
-    int fd;
+    size_t start;
+    /* offset of the first new line, sampled by --stats=stamps */
+    size_t stamp_off;
+    enum ktail_engine engine;
+    /* replaced by another file, switch once the rest is printed */
+    int rotated;
+    /* part of a --dir directory, which notices replaced files itself */
+    int in_dir;
+    /* lines or bytes of a pipe, which are dropped for -n +K and -c +N */
+    size_t skip;
+    /* the writers of a pipe are gone, it's done */
+    int eof;
+    /* a line of a pipe has been cut, which is reported once */
+    int cut;
+    /* state of the watcher */
+    struct watcher *watcher;
+    size_t watch_idx;
     int wd;
-#endif
+    /* watch of the parent directory in -F mode (wd or fd) */
+    int dir_watch;
+    size_t name_hash;           /* of dir_watch and the name, inotify only */
+    int ready;
+    /* size and links seen by the poll backend */
+    size_t poll_size;
+    nlink_t poll_nlink;
+};
+
+/* files followed by one watcher, see ktail_follower_step() */
+struct ktail_follower;
+
+enum ktail_dir_event {
+    KTAIL_DIR_ADDED,
+    KTAIL_DIR_REMOVED,
 };
 
-/* memory handling */
-struct ktail_context *ktail_init(void);
+/*
+ * Called for the files of a watched directory, before an added file is
+ * printed and before a removed one is closed. For added files it returns 1 if
+ * it has set ctx->bytes to resume from (e.g. state_attach()), 0 otherwise or a
+ * negative error code to skip the file.
+ */
+typedef int (*ktail_dir_fn)(struct ktail_context *ctx,
+                            enum ktail_dir_event event, void *arg);
+
+/* defaults of the command line, everything else is zero */
+void ktail_options_init(struct ktail_options *opts);
+
+/* memory handling, file has to outlive the context */
+struct ktail_context *ktail_init(const char *file,
+                                 const struct ktail_options *opts);
 void ktail_free(struct ktail_context *ctx);
 
+/* "-" stands for standard input, which is read from a duplicate of fd 0 */
+int ktail_is_stdin(const char *file);
+
 /* functions */
 int ktail_open(struct ktail_context *ctx);
 int ktail_reopen(struct ktail_context *ctx);
 void ktail_close(struct ktail_context *ctx);
 int ktail_read(struct ktail_context *ctx);
 int ktail_read_and_print(struct ktail_context *ctx);
-int ktail_wait(struct ktail_context *ctx);
-void ktail_print(const struct ktail_context *ctx);
-int ktail_wait_init(struct ktail_context *ctx);
-void ktail_wait_close(struct ktail_context *ctx);
+int ktail_next_line(const struct ktail_context *ctx, size_t *pos,
+                    struct ktail_line *line);
+int ktail_print(struct ktail_context *ctx);
+
+/*
+ * Following: the backend, coalescing, polling and io_uring are taken from
+ * opts. Each step blocks until files changed and prints their new data. It
+ * returns 0, WAIT_STOP on SIGINT/SIGTERM or once nothing is left to follow
+ * (pipes leave at their end) or a negative error code.
+ */
+struct ktail_follower *ktail_follower_init(const struct ktail_options *opts);
+int ktail_follower_add(struct ktail_follower *f, struct ktail_context *ctx);
+void ktail_follower_remove(struct ktail_follower *f,
+                           struct ktail_context *ctx);
+/*
+ * Follows the regular files of dir, whose names match the fnmatch() pattern
+ * (NULL for all). Present files get their tail printed, files created later
+ * are printed from their beginning. Deleted and moved away files are dropped
+ * once their rest is printed. fn may be NULL.
+ */
+int ktail_follower_add_dir(struct ktail_follower *f, const char *dir,
+                           const char *pattern, ktail_dir_fn fn, void *arg);
+int ktail_follower_step(struct ktail_follower *f);
+/* limits the following steps to block msec at most, -1 for no limit */
+void ktail_follower_timeout(struct ktail_follower *f, int msec);
+/*
+ * Makes the next step return WAIT_STOP. It's async-signal-safe, a step blocked
+ * in its wait returns once the signal interrupted it.
+ */
+void ktail_follower_stop(struct ktail_follower *f);
+/* fd which becomes readable if a step has work to do, or -1 */
+int ktail_follower_fd(const struct ktail_follower *f);
+void ktail_follower_free(struct ktail_follower *f);
 
 #endif /* _KTAIL_H_ */
@@ -0,0 +1,364 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+
+#include "lindex.h"
+
+#include "ktail.h"
+#include "scan.h"
+#include "utils.h"
+
+#define LINDEX_MAGIC   "KTAILIDX"
+#define LINDEX_VERSION 1
+#define LINDEX_BLOCK   (1024 * 1024)
+/* newlines are only located within sub blocks, which contain a checkpoint */
+#define LINDEX_SUB     4096
+
+/* followed by nr offsets, in host byte order */
+struct lindex_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t step;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t nr;
+};
+
+struct line_index {
+    char *path;
+    int fd;                     /* sidecar, -1 if indexed in memory only */
+    dev_t dev;
+    ino_t ino;
+    uint64_t *offsets;          /* offsets[i] is the start of line i * step */
+    size_t nr, cap;
+    size_t saved;               /* offsets in the sidecar */
+    size_t indexed;             /* bytes counted */
+    size_t lines;               /* newlines within the indexed bytes */
+    int partial;                /* the last indexed byte isn't a newline */
+    int invalid;
+    char *buf;
+};
+
+static void lindex_add(struct line_index *idx, size_t offset)
+{
+    if (idx->nr == idx->cap) {
+        uint64_t *offsets;
+
+        idx->cap = idx->cap ? idx->cap * 2 : 64;
+        offsets = kmalloc_array(idx->cap, sizeof(*offsets));
+        if (idx->nr)
+            memcpy(offsets, idx->offsets, idx->nr * sizeof(*offsets));
+        kfree(idx->offsets);
+        idx->offsets = offsets;
+    }
+
+    idx->offsets[idx->nr++] = offset;
+}
+
+/* the sidecar is a cache, it's dropped instead of failing */
+static void lindex_drop_sidecar(struct line_index *idx)
+{
+    warn_errno("Failed to write index '%s', indexing in memory", idx->path);
+    close(idx->fd);
+    idx->fd = -1;
+}
+
+/* the offsets are written before the header, which makes them valid */
+static void lindex_save(struct line_index *idx)
+{
+    struct lindex_header hdr;
+    size_t len = (idx->nr - idx->saved) * sizeof(*idx->offsets);
+    off_t off = sizeof(hdr) + idx->saved * sizeof(*idx->offsets);
+
+    if (idx->fd < 0 || idx->nr == idx->saved)
+        return;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LINDEX_MAGIC, sizeof(hdr.magic));
+    hdr.version = LINDEX_VERSION;
+    hdr.step = LINDEX_STEP;
+    hdr.dev = idx->dev;
+    hdr.ino = idx->ino;
+    hdr.nr = idx->nr;
+
+    if (pwrite(idx->fd, idx->offsets + idx->saved, len, off) != (ssize_t)len ||
+        pwrite(idx->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        lindex_drop_sidecar(idx);
+        return;
+    }
+    idx->saved = idx->nr;
+}
+
+static void lindex_reset(struct line_index *idx, const struct ktail_context *ctx)
+{
+    idx->dev = ctx->dev;
+    idx->ino = ctx->ino;
+    idx->nr = 0;
+    idx->saved = 0;
+    idx->indexed = 0;
+    idx->lines = 0;
+    idx->partial = 0;
+    idx->invalid = 0;
+    lindex_add(idx, 0);
+
+    if (idx->fd >= 0 && ftruncate(idx->fd, 0))
+        lindex_drop_sidecar(idx);
+}
+
+/* returns the data at off, which is read into the buffer unless mapped */
+static const char *lindex_data(struct line_index *idx,
+                               const struct ktail_context *ctx, size_t off,
+                               size_t len)
+{
+    if (ctx->map && off + len <= ctx->map_size)
+        return ctx->map + off;
+
+    if (!idx->buf)
+        idx->buf = kmalloc(LINDEX_BLOCK);
+    if (pread_full(ctx->fd, idx->buf, len, off) != (ssize_t)len)
+        return NULL;
+
+    return idx->buf;
+}
+
+/*
+ * Validates the sidecar against the file. The last checkpoint has to be within
+ * the file and preceded by a newline, otherwise the file has been truncated.
+ */
+static int lindex_load(struct line_index *idx, const struct ktail_context *ctx)
+{
+    struct lindex_header hdr;
+    ssize_t rc, len;
+    uint64_t last;
+
+    rc = pread_full(idx->fd, (char *)&hdr, sizeof(hdr), 0);
+    if (rc == 0)
+        return -ENOENT;
+    if (rc != sizeof(hdr) ||
+        memcmp(hdr.magic, LINDEX_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != LINDEX_VERSION || hdr.step != LINDEX_STEP ||
+        hdr.dev != (uint64_t)ctx->dev || hdr.ino != (uint64_t)ctx->ino ||
+        !hdr.nr || hdr.nr > ctx->size / LINDEX_STEP + 1)
+        return -EINVAL;
+
+    if (idx->cap < hdr.nr) {
+        kfree(idx->offsets);
+        idx->offsets = kmalloc_array(hdr.nr, sizeof(*idx->offsets));
+        idx->cap = hdr.nr;
+    }
+    len = hdr.nr * sizeof(*idx->offsets);
+    if (pread_full(idx->fd, (char *)idx->offsets, len, sizeof(hdr)) != len)
+        return -EINVAL;
+    idx->nr = hdr.nr;
+
+    for (size_t i = 1; i < idx->nr; ++i)
+        if (idx->offsets[i] <= idx->offsets[i - 1])
+            return -EINVAL;
+    last = idx->offsets[idx->nr - 1];
+    if (idx->offsets[0] || last > ctx->size)
+        return -EINVAL;
+    if (last) {
+        const char *p = lindex_data(idx, ctx, last - 1, 1);
+
+        if (!p || *p != '\n')
+            return -EINVAL;
+    }
+
+    /* the lines after the last checkpoint are counted again */
+    idx->saved = idx->nr;
+    idx->indexed = last;
+    idx->lines = (idx->nr - 1) * LINDEX_STEP;
+
+    return 0;
+}
+
+struct line_index *lindex_open(const struct ktail_context *ctx)
+{
+    struct line_index *idx;
+    size_t len;
+    int ret;
+
+    if (!ctx) {
+        print_err("'ctx': NULL pointer passed to '%s'", __func__);
+        return NULL;
+    }
+
+    idx = kzmalloc(sizeof(*idx));
+    len = strlen(ctx->file) + sizeof(LINDEX_SUFFIX);
+    idx->path = kmalloc(len);
+    snprintf(idx->path, len, "%s%s", ctx->file, LINDEX_SUFFIX);
+
+    idx->fd = open(idx->path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (idx->fd < 0)
+        warn_errno("Failed to open index '%s', indexing in memory", idx->path);
+
+    ret = idx->fd >= 0 ? lindex_load(idx, ctx) : -ENOENT;
+    if (ret == -EINVAL)
+        warn("Index '%s' is outdated, rebuilding it", idx->path);
+    if (ret)
+        lindex_reset(idx, ctx);
+
+    return idx;
+}
+
+void lindex_close(struct line_index *idx)
+{
+    if (!idx)
+        return;
+
+    lindex_save(idx);
+    if (idx->fd >= 0)
+        close(idx->fd);
+    kfree(idx->buf);
+    kfree(idx->offsets);
+    kfree(idx->path);
+    kfree(idx);
+}
+
+void lindex_invalidate(struct line_index *idx)
+{
+    ASSERT_PARAM_NOT_NULL_VOID(idx);
+
+    idx->invalid = 1;
+}
+
+/* counts the newlines of data at base and records the checkpoints */
+static void lindex_count(struct line_index *idx, const char *data, size_t len,
+                         size_t base)
+{
+    for (size_t pos = 0; pos < len; pos += LINDEX_SUB) {
+        size_t sub = len - pos > LINDEX_SUB ? LINDEX_SUB : len - pos;
+        const char *p = data + pos, *end = p + sub, *nl;
+        size_t cnt = count_newlines(p, sub);
+
+        if (idx->lines % LINDEX_STEP + cnt < LINDEX_STEP) {
+            idx->lines += cnt;
+            continue;
+        }
+
+        while ((nl = scan_newline(p, end - p))) {
+            p = nl + 1;
+            if (++idx->lines % LINDEX_STEP == 0)
+                lindex_add(idx, base + (p - data));
+        }
+    }
+
+    if (len)
+        idx->partial = data[len - 1] != '\n';
+}
+
+int lindex_update(struct line_index *idx, const struct ktail_context *ctx,
+                  size_t end)
+{
+    ASSERT_PARAM_NOT_NULL(idx);
+    ASSERT_PARAM_NOT_NULL(ctx);
+
+    if (idx->invalid || idx->dev != ctx->dev || idx->ino != ctx->ino ||
+        end < idx->indexed)
+        lindex_reset(idx, ctx);
+
+    while (idx->indexed < end) {
+        size_t len = end - idx->indexed;
+        const char *data;
+
+        if (len > LINDEX_BLOCK)
+            len = LINDEX_BLOCK;
+
+        data = lindex_data(idx, ctx, idx->indexed, len);
+        if (!data) {
+            print_err_errno("Failed to index '%s'", ctx->file);
+            return -EIO;
+        }
+        lindex_count(idx, data, len, idx->indexed);
+        idx->indexed += len;
+    }
+
+    lindex_save(idx);
+
+    return 0;
+}
+
+int lindex_nr_lines(struct line_index *idx, const struct ktail_context *ctx,
+                    size_t *nr_lines)
+{
+    ASSERT_PARAM_NOT_NULL(nr_lines);
+
+    if (lindex_update(idx, ctx, ctx->size))
+        return -EIO;
+
+    *nr_lines = idx->lines + idx->partial;
+
+    return 0;
+}
+
+int lindex_line_offset(struct line_index *idx, const struct ktail_context *ctx,
+                       size_t line, size_t *offset)
+{
+    size_t off, skip;
+
+    ASSERT_PARAM_NOT_NULL(offset);
+
+    if (lindex_update(idx, ctx, ctx->size))
+        return -EIO;
+
+    if (line > idx->lines) {
+        *offset = ctx->size;
+        return 0;
+    }
+
+    /* the checkpoint before the line, then less than a step forward */
+    off = idx->offsets[line / LINDEX_STEP];
+    skip = line % LINDEX_STEP;
+
+    while (skip) {
+        size_t len = ctx->size - off, cnt;
+        const char *data, *p;
+
+        if (len > LINDEX_BLOCK)
+            len = LINDEX_BLOCK;
+
+        data = lindex_data(idx, ctx, off, len);
+        if (!data) {
+            print_err_errno("Failed to read '%s'", ctx->file);
+            return -EIO;
+        }
+
+        cnt = count_newlines(data, len);
+        if (cnt < skip) {
+            skip -= cnt;
+            off += len;
+            continue;
+        }
+
+        for (p = data; skip; --skip)
+            p = scan_newline(p, data + len - p) + 1;
+        off += p - data;
+    }
+
+    *offset = off;
+
+    return 0;
+}
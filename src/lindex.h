@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _LINDEX_H_
+#define _LINDEX_H_
+
+#include <stddef.h>
+
+struct ktail_context;
+struct line_index;
+
+/*
+ * Sparse line index of a file, kept in the sidecar file <file>.ktail-index. The
+ * offset of every LINDEX_STEP-th line is recorded, so the start of any line is
+ * found by one lookup and a scan over less than LINDEX_STEP lines.
+ */
+#define LINDEX_STEP 4096
+#define LINDEX_SUFFIX ".ktail-index"
+
+/* loads the sidecar of ctx->file, an outdated one is discarded */
+struct line_index *lindex_open(const struct ktail_context *ctx);
+void lindex_close(struct line_index *idx);
+
+/* the file has been truncated, the next update starts over */
+void lindex_invalidate(struct line_index *idx);
+
+/*
+ * Indexes the file of ctx up to end. The index starts over if the file has been
+ * replaced or truncated.
+ */
+int lindex_update(struct line_index *idx, const struct ktail_context *ctx,
+                  size_t end);
+
+/* number of lines up to ctx->size, an unterminated last line counts */
+int lindex_nr_lines(struct line_index *idx, const struct ktail_context *ctx,
+                    size_t *nr_lines);
+
+/* offset of line (starting at 0), or ctx->size if the file is shorter */
+int lindex_line_offset(struct line_index *idx, const struct ktail_context *ctx,
+                       size_t line, size_t *offset);
+
+#endif /* _LINDEX_H_ */
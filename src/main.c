@@ -19,31 +19,137 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <limits.h>
 #include <getopt.h>
 #include <signal.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 
-#include "config.h"
 #include "utils.h"
 #include "ktail.h"
+#include "filter.h"
+#include "merge.h"
+#include "output.h"
+#include "state.h"
+#include "stats.h"
+#include "tstamp.h"
+#include "ktail_config.h"
 
 static volatile int stop;
+static volatile sig_atomic_t dump_stats;
+/* stopped by the termination signals */
+static struct ktail_follower *follower;
+
+enum {
+    OPT_COALESCE = 256,
+    OPT_BACKEND,
+    OPT_POLL_MIN,
+    OPT_POLL_MAX,
+    OPT_IO_URING,
+    OPT_STATE_FILE,
+    OPT_INDEX,
+    OPT_SINCE,
+    OPT_UNTIL,
+    OPT_STATS,
+    OPT_MATCH,
+    OPT_EXCLUDE,
+    OPT_REGEX,
+    OPT_MERGE,
+    OPT_MERGE_WINDOW,
+    OPT_DIR,
+};
 
 static struct option long_options[] = {
-    { "number" , required_argument, NULL, 'n' },
-    { "follow" , no_argument      , NULL, 'f' },
-    { "version", no_argument      , NULL, 'v' },
-    { "help"   , no_argument      , NULL, 'h' },
-    { NULL     , 0                , NULL,  0  }
+    { "number"      , required_argument, NULL, 'n'              },
+    { "bytes"       , required_argument, NULL, 'c'              },
+    { "since"       , required_argument, NULL, OPT_SINCE        },
+    { "until"       , required_argument, NULL, OPT_UNTIL        },
+    { "follow"      , optional_argument, NULL, 'f'              },
+    { "dir"         , required_argument, NULL, OPT_DIR          },
+    { "coalesce"    , required_argument, NULL, OPT_COALESCE     },
+    { "backend"     , required_argument, NULL, OPT_BACKEND      },
+    { "poll-min"    , required_argument, NULL, OPT_POLL_MIN     },
+    { "poll-max"    , required_argument, NULL, OPT_POLL_MAX     },
+    { "io-uring"    , no_argument      , NULL, OPT_IO_URING     },
+    { "state-file"  , required_argument, NULL, OPT_STATE_FILE   },
+    { "index"       , no_argument      , NULL, OPT_INDEX        },
+    { "stats"       , optional_argument, NULL, OPT_STATS        },
+    { "match"       , required_argument, NULL, OPT_MATCH        },
+    { "exclude"     , required_argument, NULL, OPT_EXCLUDE      },
+    { "regex"       , no_argument      , NULL, OPT_REGEX        },
+    { "merge"       , no_argument      , NULL, OPT_MERGE        },
+    { "merge-window", required_argument, NULL, OPT_MERGE_WINDOW },
+    { "version"     , no_argument      , NULL, 'v'              },
+    { "help"        , no_argument      , NULL, 'h'              },
+    { NULL          , 0                , NULL,  0               }
 };
 
+/* parses [+]<count>[K|M|G], the plus counts from the beginning of the file */
+static int parse_count(const char *str, long *res, int *from_start)
+{
+    char buf[32];
+    size_t len;
+    long mult = 1;
+
+    *from_start = *str == '+';
+    if (*from_start)
+        str++;
+
+    len = strlen(str);
+    if (!len || len >= sizeof(buf))
+        return -EINVAL;
+    memcpy(buf, str, len + 1);
+
+    switch (buf[len - 1]) {
+    case 'G':
+        mult *= 1024;
+        /* fall through */
+    case 'M':
+        mult *= 1024;
+        /* fall through */
+    case 'K':
+        mult *= 1024;
+        buf[len - 1] = '\0';
+        break;
+    }
+
+    if (kstrtol(buf, 10, res) || *res < 0 || *res > LONG_MAX / mult)
+        return -EINVAL;
+    *res *= mult;
+
+    return 0;
+}
+
 __attribute__((noreturn)) static void print_usage_and_die(int ret)
 {
-    fprintf(stderr, "ktail [options] <file>\n");
+    fprintf(stderr, "ktail [options] [<file>...]\n");
+    fprintf(stderr, "without <file> or if it is -, standard input is read\n");
     fprintf(stderr, "options:\n");
-    fprintf(stderr, "  --number, -n <lines>: last <lines> lines\n");
-    fprintf(stderr, "  --follow, -f: follow output\n");
+    fprintf(stderr, "  --number, -n [+]<lines>: last <lines> lines, or from line <lines> on\n");
+    fprintf(stderr, "  --bytes, -c [+]<bytes>[K|M|G]: last <bytes> bytes, or from byte <bytes> on\n");
+    fprintf(stderr, "  --since <time>: lines stamped at <time> or later\n");
+    fprintf(stderr, "  --until <time>: lines stamped at <time> or earlier\n");
+    fprintf(stderr, "  --follow[=descriptor], -f: follow output\n");
+    fprintf(stderr, "  --follow=name, -F: follow output across log rotations\n");
+    fprintf(stderr, "  --dir <dir>[/<pattern>]: follow the files of <dir>, also new ones\n");
+    fprintf(stderr, "  --coalesce <usec>: wait up to <usec> for more data after a wakeup\n");
+    fprintf(stderr, "  --backend <name>: wait backend for --follow:");
+    for (int i = 0; wait_backends[i]; ++i)
+        fprintf(stderr, " %s%s", wait_backends[i]->name, i ? "" : " (default)");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "  --poll-min <usec>: polling interval of active files (default: 500)\n");
+    fprintf(stderr, "  --poll-max <usec>: polling interval of idle files (default: 500000)\n");
+    fprintf(stderr, "  --io-uring: read and write followed data via io_uring\n");
+    fprintf(stderr, "  --state-file <file>: record the offsets in <file> and resume from them\n");
+    fprintf(stderr, "  --index: keep a line index in <file>.ktail-index\n");
+    fprintf(stderr, "  --stats[=stamps]: report counters on SIGUSR1 and at exit\n");
+    fprintf(stderr, "  --match <pattern>: only print lines containing <pattern>\n");
+    fprintf(stderr, "  --exclude <pattern>: don't print lines containing <pattern>\n");
+    fprintf(stderr, "  --regex: patterns are POSIX extended regular expressions\n");
+    fprintf(stderr, "  --merge: print the lines of all files in the order of their timestamps\n");
+    fprintf(stderr, "  --merge-window <usec>: hold lines of --merge up to <usec> (default: 500000)\n");
     fprintf(stderr, "Ktail version 1.3, Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>\n");
 
     ret ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
@@ -53,17 +159,49 @@ static void term_handler(int sig)
 {
     (void)sig;
     stop = 1;
+    if (follower)
+        ktail_follower_stop(follower);
 }
 
+static void stats_handler(int sig)
+{
+    (void)sig;
+    dump_stats = 1;
+}
+
+/* pipes, FIFOs and devices are read as a stream */
 static int is_tailable(const char *file)
 {
     struct stat sb;
 
+    if (ktail_is_stdin(file))
+        return 1;
+
     /* follow symlinks */
-    if (stat(file, &sb))
-        err_errno("stat() failed");
+    if (stat(file, &sb)) {
+        print_err_errno("stat() failed for '%s'", file);
+        return 0;
+    }
 
-    return S_ISREG(sb.st_mode);
+    if (S_ISDIR(sb.st_mode)) {
+        print_err("The file '%s' cannot be tailed.", file);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void raise_fd_limit(size_t nr_files)
+{
+    struct rlimit rl;
+
+    /* each file needs one fd */
+    if (getrlimit(RLIMIT_NOFILE, &rl) || rl.rlim_cur >= nr_files + 32)
+        return;
+
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl))
+        warn_errno("setrlimit() failed");
 }
 
 static void setup_signals(void)
@@ -80,86 +218,322 @@ static void setup_signals(void)
         err_errno("sigaction() failed");
 }
 
-static int ktail(void)
+/* the report is written by the main loop, SIGUSR1 only interrupts the wait */
+static void setup_stats(void)
 {
+    struct sigaction sa;
+
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = stats_handler;
+    sa.sa_flags = 0;
+
+    if (sigaction(SIGUSR1, &sa, NULL))
+        err_errno("sigaction() failed");
+}
+
+/* opens, reads and prints the tail of a file, returns NULL on errors */
+static struct ktail_context *ktail_file(const char *file,
+                                        const struct ktail_options *opts,
+                                        struct state *state,
+                                        struct merge *merge)
+{
+    unsigned long long start = stats_now(opts->stats);
     struct ktail_context *ctx;
-    int ret = -EIO;
 
-    ctx = ktail_init();
+    ctx = ktail_init(file, opts);
+    if (merge)
+        merge_add(merge, ctx);
 
     if (ktail_open(ctx))
         goto out0;
 
+    /* continue at the checkpoint instead of printing the tail */
+    if (state && state_attach(state, ctx)) {
+        if (ktail_read_and_print(ctx))
+            goto out1;
+        return ctx;
+    }
+
     if (ktail_read(ctx))
         goto out1;
 
-    ktail_print(ctx);
+    if (ktail_print(ctx))
+        goto out1;
+    STATS_ADD(opts->stats, print_ns, stats_now(opts->stats) - start);
 
-    ret = 0;
+    return ctx;
 
 out1:
+    if (state)
+        state_detach(state, ctx);
     ktail_close(ctx);
 out0:
+    if (merge)
+        merge_remove(merge, ctx);
     ktail_free(ctx);
 
+    return NULL;
+}
+
+static void ktail_file_close(struct ktail_context *ctx, struct state *state,
+                             struct merge *merge)
+{
+    if (state)
+        state_detach(state, ctx);
+    if (merge)
+        merge_remove(merge, ctx);
+    ktail_close(ctx);
+    ktail_free(ctx);
+}
+
+/* the files of --dir take part in the state file and the merge as well */
+struct dir_hooks {
+    struct state *state;
+    struct merge *merge;
+};
+
+static int dir_event(struct ktail_context *ctx, enum ktail_dir_event event,
+                     void *arg)
+{
+    struct dir_hooks *hooks = arg;
+
+    if (event == KTAIL_DIR_REMOVED) {
+        if (hooks->state)
+            state_detach(hooks->state, ctx);
+        if (hooks->merge)
+            merge_remove(hooks->merge, ctx);
+        return 0;
+    }
+
+    if (hooks->merge)
+        merge_add(hooks->merge, ctx);
+
+    return hooks->state ? state_attach(hooks->state, ctx) : 0;
+}
+
+/* <dir>[/<pattern>], a last component with wildcards is the pattern */
+static int ktail_dir(struct ktail_follower *f, char *arg,
+                     struct dir_hooks *hooks)
+{
+    char *slash = strrchr(arg, '/'), *pattern = slash ? slash + 1 : arg;
+    const char *dir = arg;
+
+    if (!strpbrk(pattern, "*?["))
+        return ktail_follower_add_dir(f, arg, NULL, dir_event, hooks);
+
+    if (!slash)
+        dir = ".";
+    else if (slash == arg)
+        dir = "/";
+    else
+        *slash = '\0';
+
+    return ktail_follower_add_dir(f, dir, pattern, dir_event, hooks);
+}
+
+static int ktail(const char **files, size_t nr_files,
+                 const struct ktail_options *opts, struct state *state,
+                 struct merge *merge)
+{
+    int ret = 0;
+
+    for (size_t i = 0; i < nr_files; ++i) {
+        struct ktail_context *ctx = ktail_file(files[i], opts, state, merge);
+        if (!ctx) {
+            ret = -EIO;
+            continue;
+        }
+        ktail_file_close(ctx, state, merge);
+    }
+
+    if (merge && merge_flush(merge, 1))
+        ret = -EIO;
+
+    if (state && state_save(state, 1))
+        ret = -EIO;
+
     return ret;
 }
 
-static int ktail_with_follow(void)
+static int ktail_with_follow(const char **files, size_t nr_files,
+                             char **dirs, size_t nr_dirs,
+                             const struct ktail_options *opts,
+                             struct state *state, struct merge *merge)
 {
-    struct ktail_context *ctx;
+    struct dir_hooks hooks = { state, merge };
+    struct ktail_context **ctxs;
+    struct ktail_follower *f;
+    size_t nr = 0;
     int ret = -EIO;
 
     setup_signals();
 
     /* tail */
-    ctx = ktail_init();
-
-    if (ktail_open(ctx))
+    ctxs = kmalloc_array(nr_files, sizeof(*ctxs));
+    for (size_t i = 0; i < nr_files; ++i) {
+        struct ktail_context *ctx = ktail_file(files[i], opts, state, merge);
+        if (ctx)
+            ctxs[nr++] = ctx;
+    }
+    if (!nr && !nr_dirs)
         goto out0;
 
-    if (ktail_read(ctx))
+    /* all files share one watcher */
+    f = ktail_follower_init(opts);
+    if (!f)
         goto out1;
+    follower = f;
+    for (size_t i = 0; i < nr; ++i)
+        if (ktail_follower_add(f, ctxs[i]))
+            goto out2;
+    for (size_t i = 0; i < nr_dirs; ++i)
+        if (ktail_dir(f, dirs[i], &hooks))
+            goto out2;
 
-    ktail_print(ctx);
+    /* the tails are complete, only followed lines are held back */
+    if (merge && merge_flush(merge, 1))
+        goto out2;
 
     /* wait */
-    ktail_wait_init(ctx);
     while (!stop) {
-        if (ktail_wait(ctx))
-            goto out2;
-        if (ktail_reopen(ctx))
+        int rc;
+
+        if (merge)
+            ktail_follower_timeout(f, merge_timeout(merge));
+        rc = ktail_follower_step(f);
+        if (rc < 0)
             goto out2;
-        if (ktail_read_and_print(ctx))
+        if (rc == WAIT_STOP)
+            break;
+        if (merge && merge_flush(merge, 0))
             goto out2;
+
+        if (state)
+            state_save(state, 0);
+        if (dump_stats) {
+            dump_stats = 0;
+            stats_dump(opts->stats, stderr);
+        }
     }
 
-    ret = 0;
+    ret = nr == nr_files ? 0 : -EIO;
+    if (merge && merge_flush(merge, 1))
+        ret = -EIO;
 
 out2:
-    ktail_wait_close(ctx);
+    follower = NULL;
+    ktail_follower_free(f);
 out1:
-    ktail_close(ctx);
+    for (size_t i = 0; i < nr; ++i)
+        ktail_file_close(ctxs[i], state, merge);
+    if (state && state_save(state, 1))
+        ret = -EIO;
 out0:
-    ktail_free(ctx);
+    kfree(ctxs);
 
     return ret;
 }
 
 int main(int argc, char *argv[])
 {
-    char *number_str = NULL;
-    long n = 1000;
-    int c, res;
+    char *number_str = NULL, *coalesce_str = NULL;
+    char *poll_min_str = NULL, *poll_max_str = NULL;
+    char *since_str = NULL, *until_str = NULL;
+    const char *state_file = NULL, **files, *stdin_file = "-";
+    char *merge_window_str = NULL;
+    long n, coalesce, poll_min, poll_max, merge_window = 500000;
+    struct stats stats = { .wakeups = 0 };
+    struct ktail_options opts;
+    struct state *state = NULL;
+    struct merge *merge = NULL;
+    struct output *out;
+    int c, res, failed = 0, regex = 0, merged = 0;
+    size_t nr = 0, nr_files, nr_patterns = 0;
+    const char *patterns[argc];
+    int exclude[argc];
+    char *dirs[argc];
+    size_t nr_dirs = 0;
+
+    ktail_options_init(&opts);
+    /* the command line owns the process, the epoll loop takes its signals */
+    opts.signals = 1;
+    n = opts.n;
+    coalesce = opts.coalesce;
+    poll_min = opts.poll_min;
+    poll_max = opts.poll_max;
 
     /* get args */
-    while ((c = getopt_long(argc, argv, "n:fvh", long_options, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, "n:c:fFvh", long_options, NULL)) != -1) {
         switch (c) {
         case 'n':
             number_str = optarg;
+            opts.bytes = 0;
+            break;
+        case 'c':
+            number_str = optarg;
+            opts.bytes = 1;
+            break;
+        case OPT_STATS:
+            opts.stats = &stats;
+            if (optarg && strcmp(optarg, "stamps"))
+                err("Invalid argument for --stats");
+            if (optarg)
+                stats.stamps = 1;
+            break;
+        case OPT_SINCE:
+            since_str = optarg;
+            break;
+        case OPT_UNTIL:
+            until_str = optarg;
             break;
         case 'f':
-            config.f_flag = 1;
+            opts.follow = 1;
+            if (!optarg || !strcmp(optarg, "descriptor"))
+                break;
+            if (strcmp(optarg, "name"))
+                err("Invalid argument for --follow");
+            /* fall through */
+        case 'F':
+            opts.follow = 1;
+            opts.follow_name = 1;
+            break;
+        case OPT_DIR:
+            dirs[nr_dirs++] = optarg;
+            break;
+        case OPT_COALESCE:
+            coalesce_str = optarg;
+            break;
+        case OPT_BACKEND:
+            opts.backend = optarg;
+            break;
+        case OPT_POLL_MIN:
+            poll_min_str = optarg;
+            break;
+        case OPT_POLL_MAX:
+            poll_max_str = optarg;
+            break;
+        case OPT_IO_URING:
+            opts.io_uring = 1;
+            break;
+        case OPT_STATE_FILE:
+            state_file = optarg;
+            break;
+        case OPT_INDEX:
+            opts.index = 1;
+            break;
+        case OPT_MATCH:
+        case OPT_EXCLUDE:
+            patterns[nr_patterns] = optarg;
+            exclude[nr_patterns++] = c == OPT_EXCLUDE;
+            break;
+        case OPT_REGEX:
+            regex = 1;
+            break;
+        case OPT_MERGE:
+            merged = 1;
+            break;
+        case OPT_MERGE_WINDOW:
+            merge_window_str = optarg;
             break;
         case 'v':
         case 'h':
@@ -168,21 +542,104 @@ int main(int argc, char *argv[])
             print_usage_and_die(1);
         }
     }
-    if (argc - optind != 1)
-        print_usage_and_die(1);
-
     /* set args */
-    config.file = argv[optind];
-    if (number_str && (kstrtol(number_str, 10, &n) || n <= 0))
+    files = (const char **)argv + optind;
+    nr_files = argc - optind;
+    if (!nr_files && !nr_dirs) {
+        files = &stdin_file;
+        nr_files = 1;
+    }
+    opts.headers = nr_files > 1 || nr_dirs;
+    if (opts.bytes && parse_count(number_str, &n, &opts.from_start))
+        err("Invalid argument for --bytes");
+    if (!opts.bytes && number_str &&
+        (parse_count(number_str, &n, &opts.from_start) ||
+         (!opts.from_start && n <= 0)))
         err("Invalid argument for --number");
-    config.n = n;
+    opts.n = n;
+    if (since_str && tstamp_parse_arg(since_str, &opts.since))
+        err("Invalid argument for --since");
+    if (until_str && tstamp_parse_arg(until_str, &opts.until))
+        err("Invalid argument for --until");
+    opts.has_since = !!since_str;
+    opts.has_until = !!until_str;
+    if ((since_str || until_str) && number_str)
+        err("--since and --until cannot be combined with --number or --bytes");
+    if (until_str && opts.follow)
+        err("--until cannot be combined with --follow");
+    if (nr_dirs && !opts.follow)
+        err("--dir requires --follow");
+    if (nr_dirs && opts.follow_name)
+        err("--dir cannot be combined with --follow=name, it tracks renames itself");
+    if (coalesce_str && (kstrtol(coalesce_str, 10, &coalesce) || coalesce < 0))
+        err("Invalid argument for --coalesce");
+    opts.coalesce = coalesce;
+    if (opts.backend && !wait_backend_find(opts.backend))
+        err("Unknown backend '%s'", opts.backend);
+    if (poll_min_str && (kstrtol(poll_min_str, 10, &poll_min) || poll_min <= 0))
+        err("Invalid argument for --poll-min");
+    if (poll_max_str && (kstrtol(poll_max_str, 10, &poll_max) || poll_max < poll_min))
+        err("Invalid argument for --poll-max");
+    opts.poll_min = poll_min;
+    opts.poll_max = poll_max;
+    if (merge_window_str &&
+        (kstrtol(merge_window_str, 10, &merge_window) || merge_window < 0))
+        err("Invalid argument for --merge-window");
+    if (merged && opts.io_uring)
+        err("--merge cannot be combined with --io-uring");
+    if (nr_patterns) {
+        if (opts.bytes)
+            err("--bytes cannot be combined with --match or --exclude");
+        if (opts.from_start)
+            err("--number +K cannot be combined with --match or --exclude");
+        if (since_str || until_str)
+            err("--since and --until cannot be combined with --match or --exclude");
+        opts.filter = filter_init(regex);
+        for (size_t i = 0; i < nr_patterns; ++i)
+            if (filter_add(opts.filter, patterns[i], exclude[i]))
+                return EXIT_FAILURE;
+    }
 
     /* sanity checks */
-    if (!is_tailable(config.file))
-        err("The file '%s' cannot be tailed.", config.file);
+    for (size_t i = 0; i < nr_files; ++i) {
+        if (opts.follow_name && ktail_is_stdin(files[i]))
+            err("--follow=name cannot follow standard input, it has no name");
+        if (!is_tailable(files[i])) {
+            failed = 1;
+            continue;
+        }
+        files[nr++] = files[i];
+    }
+    nr_files = nr;
+    if (!nr_files && !nr_dirs)
+        return EXIT_FAILURE;
+    /* the directories may hold any number of files */
+    raise_fd_limit(nr_dirs ? SIZE_MAX / 2 : nr_files);
+
+    if (state_file)
+        state = state_load(state_file);
+    if (opts.stats)
+        setup_stats();
+    opts.output = out = output_init(STDOUT_FILENO, opts.stats);
+
+    /* the files are printed through the merge, no headers in between */
+    if (merged) {
+        merge = merge_init(out, merge_window);
+        opts.output = merge_output(merge);
+        opts.headers = 0;
+    }
 
     /* print tail */
-    res = config.f_flag ? ktail_with_follow() : ktail();
-
-    return res ? EXIT_FAILURE : EXIT_SUCCESS;
+    res = opts.follow ?
+        ktail_with_follow(files, nr_files, dirs, nr_dirs, &opts, state,
+                          merge) :
+        ktail(files, nr_files, &opts, state, merge);
+    if (opts.stats)
+        stats_dump(opts.stats, stderr);
+    merge_free(merge);
+    output_free(out);
+    state_free(state);
+    filter_free(opts.filter);
+
+    return res || failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
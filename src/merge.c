@@ -0,0 +1,498 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+#include "merge.h"
+
+#include "ktail.h"
+#include "output.h"
+#include "tstamp.h"
+#include "utils.h"
+
+/* beyond this, held lines are released regardless of the window */
+#define MERGE_MAX_BYTES (64UL << 20)
+
+struct merge_line {
+    unsigned long long ts;      /* ns since the epoch */
+    unsigned long long arrival; /* monotonic ns */
+    size_t off;                 /* offset in buf */
+    size_t len;
+    size_t pos;                 /* offset in the file */
+};
+
+/* pending lines of one file, in file order */
+struct merge_src {
+    struct ktail_context *ctx;
+    unsigned long order;        /* breaks ties of equal timestamps */
+    int attached;
+    char *buf;
+    size_t size;
+    size_t used;
+    struct merge_line *lines;
+    size_t cap;
+    size_t first;               /* index of the oldest pending line */
+    size_t nr;                  /* end of the pending lines */
+    unsigned long long last_ts;
+};
+
+struct merge {
+    struct output *out;
+    struct output *sink;
+    unsigned long long window;  /* ns */
+    /* attached sources, sorted by ctx */
+    struct merge_src **srcs;
+    size_t nr_srcs;
+    size_t cap_srcs;
+    struct merge_src *last;
+    /* sources with pending lines, the earliest first line on top */
+    struct merge_src **heap;
+    size_t nr_heap;
+    size_t cap_heap;
+    size_t nr_idle;             /* attached sources without pending lines */
+    size_t held;                /* bytes */
+    unsigned long order;
+};
+
+static int merge_line(struct ktail_context *ctx, const struct ktail_line *slice,
+                      void *arg);
+
+static unsigned long long merge_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* doubles the capacity of an array of nr elements */
+static void *merge_grow(void *array, size_t nr, size_t *cap, size_t size)
+{
+    size_t new_cap = *cap ? *cap * 2 : 16;
+    void *new = kmalloc_array(new_cap, size);
+
+    if (nr)
+        memcpy(new, array, nr * size);
+    kfree(array);
+    *cap = new_cap;
+
+    return new;
+}
+
+struct merge *merge_init(struct output *out, unsigned long window)
+{
+    struct merge *m = kzmalloc(sizeof(*m));
+
+    m->out = out;
+    m->sink = output_init_fn(merge_line, m, 1, NULL);
+    m->window = window * 1000ULL;
+
+    return m;
+}
+
+static void merge_src_free(struct merge_src *src)
+{
+    kfree(src->buf);
+    kfree(src->lines);
+    kfree(src);
+}
+
+void merge_free(struct merge *m)
+{
+    if (!m)
+        return;
+
+    /* removed sources are only left in the heap */
+    for (size_t i = 0; i < m->nr_heap; ++i)
+        if (!m->heap[i]->attached)
+            merge_src_free(m->heap[i]);
+    for (size_t i = 0; i < m->nr_srcs; ++i)
+        merge_src_free(m->srcs[i]);
+
+    output_free(m->sink);
+    kfree(m->srcs);
+    kfree(m->heap);
+    kfree(m);
+}
+
+struct output *merge_output(struct merge *m)
+{
+    return m->sink;
+}
+
+/* index of the first source whose ctx isn't below ctx */
+static size_t merge_search(const struct merge *m,
+                           const struct ktail_context *ctx)
+{
+    size_t lo = 0, hi = m->nr_srcs;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if ((uintptr_t)m->srcs[mid]->ctx < (uintptr_t)ctx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static struct merge_src *merge_find(struct merge *m,
+                                    const struct ktail_context *ctx)
+{
+    size_t i;
+
+    /* lines of a file come in runs */
+    if (m->last && m->last->ctx == ctx)
+        return m->last;
+
+    i = merge_search(m, ctx);
+    if (i == m->nr_srcs || m->srcs[i]->ctx != ctx)
+        return NULL;
+    m->last = m->srcs[i];
+
+    return m->last;
+}
+
+void merge_add(struct merge *m, struct ktail_context *ctx)
+{
+    struct merge_src *src;
+    size_t i;
+
+    ASSERT_PARAM_NOT_NULL_VOID(m);
+    ASSERT_PARAM_NOT_NULL_VOID(ctx);
+
+    if (merge_find(m, ctx))
+        return;
+
+    src = kzmalloc(sizeof(*src));
+    src->ctx = ctx;
+    src->order = m->order++;
+    src->attached = 1;
+
+    if (m->nr_srcs == m->cap_srcs)
+        m->srcs = merge_grow(m->srcs, m->nr_srcs, &m->cap_srcs,
+                             sizeof(*m->srcs));
+    i = merge_search(m, ctx);
+    memmove(m->srcs + i + 1, m->srcs + i, (m->nr_srcs - i) * sizeof(*m->srcs));
+    m->srcs[i] = src;
+    m->nr_srcs++;
+    m->nr_idle++;
+}
+
+void merge_remove(struct merge *m, struct ktail_context *ctx)
+{
+    struct merge_src *src;
+    size_t i;
+
+    ASSERT_PARAM_NOT_NULL_VOID(m);
+
+    src = merge_find(m, ctx);
+    if (!src)
+        return;
+
+    i = merge_search(m, ctx);
+    memmove(m->srcs + i, m->srcs + i + 1,
+            (m->nr_srcs - i - 1) * sizeof(*m->srcs));
+    m->nr_srcs--;
+    m->last = NULL;
+
+    /* pending lines stay in the heap until they're released */
+    src->attached = 0;
+    src->ctx = NULL;
+    if (src->first == src->nr) {
+        m->nr_idle--;
+        merge_src_free(src);
+    }
+}
+
+static int merge_before(const struct merge_src *a, const struct merge_src *b)
+{
+    const struct merge_line *la = &a->lines[a->first];
+    const struct merge_line *lb = &b->lines[b->first];
+
+    if (la->ts != lb->ts)
+        return la->ts < lb->ts;
+
+    return a->order < b->order;
+}
+
+static void merge_heap_down(struct merge *m, size_t i)
+{
+    struct merge_src *src = m->heap[i];
+
+    while (42) {
+        size_t child = 2 * i + 1;
+
+        if (child >= m->nr_heap)
+            break;
+        if (child + 1 < m->nr_heap &&
+            merge_before(m->heap[child + 1], m->heap[child]))
+            child++;
+        if (!merge_before(m->heap[child], src))
+            break;
+        m->heap[i] = m->heap[child];
+        i = child;
+    }
+
+    m->heap[i] = src;
+}
+
+static void merge_heap_push(struct merge *m, struct merge_src *src)
+{
+    size_t i;
+
+    if (m->nr_heap == m->cap_heap)
+        m->heap = merge_grow(m->heap, m->nr_heap, &m->cap_heap,
+                             sizeof(*m->heap));
+
+    for (i = m->nr_heap++; i; ) {
+        size_t parent = (i - 1) / 2;
+
+        if (!merge_before(src, m->heap[parent]))
+            break;
+        m->heap[i] = m->heap[parent];
+        i = parent;
+    }
+
+    m->heap[i] = src;
+}
+
+/*
+ * Moves the pending data to the front of buf and grows it, so that len more
+ * bytes fit. Keeping half of it free makes the moves amortized O(1).
+ */
+static void merge_src_reserve(struct merge_src *src, size_t len)
+{
+    size_t start = src->first < src->nr ? src->lines[src->first].off : 0;
+    size_t used = src->used - start, size = src->size ? src->size : 4096;
+    char *buf = src->buf;
+
+    while (size < (used + len) * 2)
+        size *= 2;
+    if (size != src->size)
+        buf = kmalloc(size);
+    if (used)
+        memmove(buf, src->buf + start, used);
+    if (buf != src->buf) {
+        kfree(src->buf);
+        src->buf = buf;
+        src->size = size;
+    }
+
+    for (size_t i = src->first; i < src->nr; ++i)
+        src->lines[i].off -= start;
+    src->used = used;
+}
+
+/* same for the line records */
+static void merge_src_reserve_line(struct merge_src *src)
+{
+    size_t nr = src->nr - src->first, cap = src->cap ? src->cap : 64;
+    struct merge_line *lines = src->lines;
+
+    while (cap < (nr + 1) * 2)
+        cap *= 2;
+    if (cap != src->cap)
+        lines = kmalloc_array(cap, sizeof(*lines));
+    if (nr)
+        memmove(lines, src->lines + src->first, nr * sizeof(*lines));
+    if (lines != src->lines) {
+        kfree(src->lines);
+        src->lines = lines;
+        src->cap = cap;
+    }
+
+    src->first = 0;
+    src->nr = nr;
+}
+
+/* copies the line, a missing newline at EOF is added */
+static void merge_src_push(struct merge *m, struct merge_src *src,
+                           const struct ktail_line *slice)
+{
+    size_t len = slice->len;
+    int eol = len && slice->ptr[len - 1] == '\n';
+    struct merge_line *line;
+    struct timespec ts;
+
+    if (!eol)
+        len++;
+    if (src->nr == src->cap)
+        merge_src_reserve_line(src);
+    if (src->used + len > src->size)
+        merge_src_reserve(src, len);
+    line = &src->lines[src->nr++];
+
+    memcpy(src->buf + src->used, slice->ptr, slice->len);
+    if (!eol)
+        src->buf[src->used + slice->len] = '\n';
+
+    if (!tstamp_parse_ts(slice->ptr, slice->len < TSTAMP_MAX_LEN ?
+                         slice->len : TSTAMP_MAX_LEN, &ts))
+        src->last_ts = (unsigned long long)ts.tv_sec * 1000000000ULL +
+            ts.tv_nsec;
+
+    line->ts = src->last_ts;
+    line->arrival = merge_now();
+    line->off = src->used;
+    line->len = len;
+    line->pos = slice->offset;
+    src->used += len;
+    m->held += len;
+}
+
+static int merge_line(struct ktail_context *ctx, const struct ktail_line *slice,
+                      void *arg)
+{
+    struct merge *m = arg;
+    struct merge_src *src = merge_find(m, ctx);
+    int idle;
+
+    if (!src) {
+        print_err("File '%s' isn't part of the merge", ctx->file);
+        return -EINVAL;
+    }
+
+    idle = src->first == src->nr;
+    merge_src_push(m, src, slice);
+    if (idle) {
+        m->nr_idle--;
+        merge_heap_push(m, src);
+    }
+
+    /* a file, which is far behind, must not pile up the others */
+    return m->held > MERGE_MAX_BYTES ? merge_flush(m, 0) : 0;
+}
+
+/* arrival of the oldest pending line */
+static unsigned long long merge_oldest(const struct merge *m)
+{
+    unsigned long long oldest = ULLONG_MAX;
+
+    for (size_t i = 0; i < m->nr_heap; ++i) {
+        const struct merge_src *src = m->heap[i];
+
+        if (src->lines[src->first].arrival < oldest)
+            oldest = src->lines[src->first].arrival;
+    }
+
+    return oldest;
+}
+
+static int merge_emit(struct merge *m, struct output_vec *vec,
+                      const struct merge_src *src,
+                      const struct merge_line *line)
+{
+    struct output *out = m->out;
+    struct ktail_line slice = { src->buf + line->off, line->len, line->pos };
+
+    if (!out->fn)
+        return output_vec_add(out, vec, slice.ptr, slice.len);
+
+    return out->fn(src->ctx, &slice, out->arg);
+}
+
+int merge_flush(struct merge *m, int all)
+{
+    struct output_vec vec;
+    unsigned long long now = 0, oldest = 0;
+    int ret = 0;
+
+    ASSERT_PARAM_NOT_NULL(m);
+
+    vec.cnt = 0;
+    while (m->nr_heap) {
+        struct merge_src *src = m->heap[0];
+        const struct merge_line *line = &src->lines[src->first];
+
+        /* an idle file may still get earlier lines, up to the window */
+        if (!all && m->nr_idle && m->held <= MERGE_MAX_BYTES) {
+            if (!now)
+                now = merge_now();
+            if (!oldest)
+                oldest = merge_oldest(m);
+            if (oldest + m->window > now)
+                break;
+        }
+
+        ret = merge_emit(m, &vec, src, line);
+        if (ret)
+            break;
+        if (line->arrival == oldest)
+            oldest = 0;
+        m->held -= line->len;
+
+        if (++src->first < src->nr) {
+            merge_heap_down(m, 0);
+            continue;
+        }
+
+        /* the data stays valid until it's written */
+        src->first = src->nr = src->used = 0;
+        m->heap[0] = m->heap[--m->nr_heap];
+        if (m->nr_heap)
+            merge_heap_down(m, 0);
+        if (src->attached) {
+            m->nr_idle++;
+            continue;
+        }
+
+        if (vec.cnt)
+            ret = output_vec_flush(m->out, &vec);
+        merge_src_free(src);
+        if (ret)
+            break;
+    }
+
+    if (vec.cnt) {
+        int rc = output_vec_flush(m->out, &vec);
+        if (!ret)
+            ret = rc;
+    }
+
+    return ret;
+}
+
+int merge_timeout(const struct merge *m)
+{
+    unsigned long long due, now;
+
+    ASSERT_PARAM_NOT_NULL(m);
+
+    if (!m->nr_heap)
+        return -1;
+
+    now = merge_now();
+    due = merge_oldest(m) + m->window;
+    if (due <= now)
+        return 0;
+    if ((due - now) / 1000000 >= INT_MAX)
+        return INT_MAX;
+
+    return (due - now + 999999) / 1000000;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _MERGE_H_
+#define _MERGE_H_
+
+#include <stddef.h>
+
+struct ktail_context;
+struct output;
+
+/*
+ * Merges the lines of several files by their leading ISO-8601 or syslog
+ * timestamp. Lines without one inherit the timestamp of their predecessor, so
+ * e.g. stack traces stay with their message. Each file is assumed to be in
+ * order by itself, the heads of the files are kept in a min-heap.
+ *
+ * A line is released once every attached file has a later one pending. While
+ * a file is idle, lines are held for window microseconds after their arrival
+ * at most, so a lagging file delays the output by window and no more. Lines
+ * arriving later than that are printed out of order.
+ */
+struct merge *merge_init(struct output *out, unsigned long window);
+void merge_free(struct merge *m);
+
+/*
+ * Sink which collects the lines printed by the contexts, to be set as their
+ * output. The merged lines go to out, callbacks get the context of the line,
+ * or NULL for lines of removed contexts.
+ */
+struct output *merge_output(struct merge *m);
+
+void merge_add(struct merge *m, struct ktail_context *ctx);
+/* the pending lines of ctx are still merged, ctx may be freed afterwards */
+void merge_remove(struct merge *m, struct ktail_context *ctx);
+
+/* releases the lines which are due, or all of them */
+int merge_flush(struct merge *m, int all);
+
+/* msec until held lines become due, -1 if there are none */
+int merge_timeout(const struct merge *m);
+
+#endif /* _MERGE_H_ */
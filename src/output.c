@@ -0,0 +1,326 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "output.h"
+
+#include "stats.h"
+#include "utils.h"
+#include "ktail_config.h"
+
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#define RW_BUF_SIZE (256 * 1024)
+
+/* fallback chains, terminated by OUTPUT_RW */
+static const enum output_method chain_reg[] = {
+    OUTPUT_COPY_FILE_RANGE, OUTPUT_SENDFILE, OUTPUT_RW,
+};
+static const enum output_method chain_fifo[] = {
+    OUTPUT_SPLICE, OUTPUT_SENDFILE, OUTPUT_RW,
+};
+static const enum output_method chain_other[] = {
+    OUTPUT_SENDFILE, OUTPUT_SPLICE_PIPE, OUTPUT_RW,
+};
+static const enum output_method chain_none[] = {
+    OUTPUT_RW,
+};
+
+struct output *output_init(int fd, struct stats *stats)
+{
+    struct output *out = kzmalloc(sizeof(*out));
+    struct stat sb;
+
+    out->fd = fd;
+    out->stats = stats;
+    out->pipe_fds[0] = out->pipe_fds[1] = -1;
+
+    if (fstat(fd, &sb))
+        out->chain = chain_other;
+    else if (S_ISREG(sb.st_mode))
+        out->chain = chain_reg;
+    else if (S_ISFIFO(sb.st_mode))
+        out->chain = chain_fifo;
+    else
+        out->chain = chain_other;
+
+    return out;
+}
+
+struct output *output_init_fn(ktail_output_fn fn, void *arg, int lines,
+                              struct stats *stats)
+{
+    struct output *out = output_init(-1, stats);
+
+    out->fn = fn;
+    out->arg = arg;
+    out->lines = lines;
+    out->chain = chain_none;
+
+    return out;
+}
+
+void output_free(struct output *out)
+{
+    if (!out)
+        return;
+
+    if (out->pipe_fds[0] >= 0) {
+        close(out->pipe_fds[0]);
+        close(out->pipe_fds[1]);
+    }
+    kfree(out->rw_buf);
+    kfree(out);
+}
+
+static int output_unsupported(int error)
+{
+    return error == EINVAL || error == ENOSYS || error == EXDEV ||
+        error == EBADF || error == EOPNOTSUPP || error == ESPIPE;
+}
+
+/* blocks until a non-blocking fd, e.g. a pipe, is writable again */
+static int output_wait(struct output *out)
+{
+    struct pollfd pfd = { .fd = out->fd, .events = POLLOUT };
+
+    while (poll(&pfd, 1, -1) < 0)
+        if (errno != EINTR)
+            return -errno;
+
+    return 0;
+}
+
+int output_write(struct output *out, const char *buf, size_t len)
+{
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = len };
+
+    return output_writev(out, &iov, 1);
+}
+
+int output_writev(struct output *out, struct iovec *iov, int cnt)
+{
+    while (cnt) {
+        ssize_t rc = writev(out->fd, iov, cnt);
+        int ret;
+
+        STATS_INC(out->stats, syscalls);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                return -errno;
+            ret = output_wait(out);
+            if (ret)
+                return ret;
+            continue;
+        }
+
+        /* skip what has been written */
+        STATS_ADD(out->stats, bytes_written, rc);
+        while (cnt && (size_t)rc >= iov->iov_len) {
+            rc -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt) {
+            iov->iov_base = (char *)iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
+int output_vec_add(struct output *out, struct output_vec *vec, const void *buf,
+                   size_t len)
+{
+    struct iovec *last = vec->cnt ? &vec->iov[vec->cnt - 1] : NULL;
+    int ret;
+
+    if (!len)
+        return 0;
+
+    if (last && (const char *)last->iov_base + last->iov_len == buf) {
+        last->iov_len += len;
+        return 0;
+    }
+
+    if (vec->cnt == OUTPUT_VEC_MAX) {
+        ret = output_vec_flush(out, vec);
+        if (ret)
+            return ret;
+    }
+
+    vec->iov[vec->cnt].iov_base = (void *)buf;
+    vec->iov[vec->cnt].iov_len = len;
+    vec->cnt++;
+
+    return 0;
+}
+
+int output_vec_flush(struct output *out, struct output_vec *vec)
+{
+    int ret = output_writev(out, vec->iov, vec->cnt);
+
+    vec->cnt = 0;
+
+    return ret;
+}
+
+static ssize_t output_rw(struct output *out, int fd, size_t off, size_t len)
+{
+    size_t done = 0;
+
+    if (!out->rw_buf)
+        out->rw_buf = kmalloc(RW_BUF_SIZE);
+
+    while (done < len) {
+        size_t chunk = len - done > RW_BUF_SIZE ? RW_BUF_SIZE : len - done;
+        ssize_t rc = pread(fd, out->rw_buf, chunk, off + done);
+        int ret;
+
+        STATS_INC(out->stats, syscalls);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (rc == 0)
+            break;
+        STATS_ADD(out->stats, bytes_read, rc);
+
+        ret = output_write(out, out->rw_buf, rc);
+        if (ret)
+            return ret;
+        done += rc;
+    }
+
+    return done;
+}
+
+/* one step of a zero copy method, same semantics as sendfile() */
+static ssize_t output_step(struct output *out, enum output_method method,
+                           int fd, off_t *off, size_t len)
+{
+    switch (method) {
+#ifdef HAVE_COPY_FILE_RANGE
+    case OUTPUT_COPY_FILE_RANGE:
+        return copy_file_range(fd, off, out->fd, NULL, len, 0);
+#endif
+#ifdef HAVE_SENDFILE
+    case OUTPUT_SENDFILE:
+        return sendfile(out->fd, fd, off, len);
+#endif
+#ifdef HAVE_SPLICE
+    case OUTPUT_SPLICE:
+        return splice(fd, off, out->fd, NULL, len, SPLICE_F_MORE);
+    case OUTPUT_SPLICE_PIPE: {
+        ssize_t in, moved;
+
+        if (out->pipe_fds[0] < 0 && pipe(out->pipe_fds))
+            return -1;
+
+        in = splice(fd, off, out->pipe_fds[1], NULL, len, SPLICE_F_MORE);
+        if (in <= 0)
+            return in;
+
+        /* the pipe has to be drained completely */
+        for (ssize_t left = in; left > 0; left -= moved) {
+            moved = splice(out->pipe_fds[0], NULL, out->fd, NULL, left,
+                           SPLICE_F_MORE);
+            if (moved < 0 && (errno == EINTR ||
+                              (errno == EAGAIN && !output_wait(out)))) {
+                moved = 0;
+                continue;
+            }
+            if (moved <= 0) {
+                /* data is stuck in the pipe, this isn't recoverable */
+                errno = moved ? errno : EIO;
+                return -2;
+            }
+        }
+
+        return in;
+    }
+#endif
+    default:
+        errno = ENOSYS;
+        return -1;
+    }
+}
+
+ssize_t output_transfer(struct output *out, int fd, size_t off, size_t len)
+{
+    off_t pos = off;
+
+    while (pos - off < len) {
+        ssize_t rc;
+
+        if (*out->chain == OUTPUT_RW) {
+            rc = output_rw(out, fd, pos, len - (pos - off));
+            if (rc < 0)
+                return rc;
+            pos += rc;
+            break;
+        }
+
+        rc = output_step(out, *out->chain, fd, &pos, len - (pos - off));
+        STATS_INC(out->stats, syscalls);
+        if (rc == 0)
+            break;
+        if (rc == -1 && errno == EINTR)
+            continue;
+        if (rc == -1 && errno == EAGAIN) {
+            rc = output_wait(out);
+            if (rc)
+                return rc;
+            continue;
+        }
+        if (rc == -1 && output_unsupported(errno)) {
+            /* try the next method */
+            out->chain++;
+            continue;
+        }
+        if (rc < 0)
+            return -errno;
+
+        /* moved in the kernel, so it counts as read and written */
+        STATS_ADD(out->stats, bytes_read, rc);
+        STATS_ADD(out->stats, bytes_written, rc);
+    }
+
+    return pos - off;
+}
+
+int output_zero_copy(struct output *out)
+{
+    return *out->chain != OUTPUT_RW;
+}
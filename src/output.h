@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _OUTPUT_H_
+#define _OUTPUT_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+struct ktail_context;
+struct ktail_line;
+struct stats;
+
+/* iovecs per writev(), IOV_MAX is 1024 on Linux and FreeBSD */
+#define OUTPUT_VEC_MAX 1024
+
+/*
+ * Receives the printed data of ctx. The slice points into the mapping or a
+ * buffer of ctx and is only valid during the call. It returns 0, or a negative
+ * errno code, which stops printing and is passed on.
+ */
+typedef int (*ktail_output_fn)(struct ktail_context *ctx,
+                               const struct ktail_line *slice, void *arg);
+
+enum output_method {
+    OUTPUT_COPY_FILE_RANGE,     /* the fd is a regular file */
+    OUTPUT_SPLICE,              /* the fd is a pipe */
+    OUTPUT_SENDFILE,            /* anything else */
+    OUTPUT_SPLICE_PIPE,         /* splice through an intermediate pipe */
+    OUTPUT_RW,                  /* read()/write() loop */
+};
+
+/*
+ * Destination of the printed data, shared by all contexts printing to it. Data
+ * is either written to fd or passed to fn.
+ */
+struct output {
+    int fd;
+    ktail_output_fn fn;
+    void *arg;
+    /* fn gets whole lines instead of chunks */
+    int lines;
+    struct stats *stats;
+    /* fallback chain of the zero copy methods */
+    const enum output_method *chain;
+    int pipe_fds[2];
+    char *rw_buf;
+    /* file of the last "==> file <==" header */
+    const struct ktail_context *last_header;
+    int headers_printed;
+};
+
+/* slices collected for one writev() */
+struct output_vec {
+    struct iovec iov[OUTPUT_VEC_MAX];
+    int cnt;
+};
+
+/* the fd isn't closed by output_free(), stats may be NULL */
+struct output *output_init(int fd, struct stats *stats);
+struct output *output_init_fn(ktail_output_fn fn, void *arg, int lines,
+                              struct stats *stats);
+void output_free(struct output *out);
+
+/*
+ * Writes buf completely to the fd. Partial writes are continued and a
+ * non-blocking fd is waited for.
+ */
+int output_write(struct output *out, const char *buf, size_t len);
+
+/* same for an array of buffers, iov is modified */
+int output_writev(struct output *out, struct iovec *iov, int cnt);
+
+/* queues a slice, which is merged with the previous one if they're adjacent */
+int output_vec_add(struct output *out, struct output_vec *vec, const void *buf,
+                   size_t len);
+int output_vec_flush(struct output *out, struct output_vec *vec);
+
+/*
+ * Moves len bytes starting at off from fd to the output fd. The data is moved
+ * in the kernel if possible, depending on the type of the output fd. Returns
+ * the number of bytes moved, which is less than len at EOF, or a negative
+ * error code.
+ */
+ssize_t output_transfer(struct output *out, int fd, size_t off, size_t len);
+
+/* whether output_transfer() avoids copying through user space */
+int output_zero_copy(struct output *out);
+
+#endif /* _OUTPUT_H_ */
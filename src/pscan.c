@@ -0,0 +1,219 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "pscan.h"
+
+#include "scan.h"
+#include "utils.h"
+
+#define PSCAN_CHUNK_SIZE  (16 * 1024 * 1024)
+/* unmapped chunks are read in blocks, so each thread has a small buffer */
+#define PSCAN_BLOCK_SIZE  (1024 * 1024)
+#define PSCAN_MAX_THREADS 64
+
+/* window of chunks, which are counted in parallel */
+struct pscan {
+    int fd;
+    const char *map;
+    size_t size;
+    size_t first;               /* first chunk of the window */
+    size_t nr;                  /* chunks in the window */
+    size_t next;                /* next chunk to be taken, atomic */
+    size_t *counts;
+    int error;
+};
+
+static size_t pscan_chunk_len(const struct pscan *ps, size_t chunk)
+{
+    size_t off = chunk * PSCAN_CHUNK_SIZE;
+
+    return ps->size - off > PSCAN_CHUNK_SIZE ? PSCAN_CHUNK_SIZE : ps->size - off;
+}
+
+/* a mapped chunk is a single block */
+static size_t pscan_block_size(const struct pscan *ps)
+{
+    return ps->map ? PSCAN_CHUNK_SIZE : PSCAN_BLOCK_SIZE;
+}
+
+/* returns the data at off, buf is used if the file isn't mapped */
+static const char *pscan_block(const struct pscan *ps, size_t off, size_t len,
+                               char *buf)
+{
+    if (ps->map)
+        return ps->map + off;
+
+    if (pread_full(ps->fd, buf, len, off) != (ssize_t)len)
+        return NULL;
+
+    return buf;
+}
+
+static int pscan_count(const struct pscan *ps, size_t chunk, char *buf,
+                       size_t *count)
+{
+    size_t off = chunk * PSCAN_CHUNK_SIZE, step = pscan_block_size(ps);
+    size_t end = off + pscan_chunk_len(ps, chunk);
+
+    *count = 0;
+    for (; off < end; off += step) {
+        size_t len = end - off > step ? step : end - off;
+        const char *data = pscan_block(ps, off, len, buf);
+
+        if (!data)
+            return -EIO;
+        *count += count_newlines(data, len);
+    }
+
+    return 0;
+}
+
+static void *pscan_worker(void *arg)
+{
+    struct pscan *ps = arg;
+    char *buf = ps->map ? NULL : kmalloc(PSCAN_BLOCK_SIZE);
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&ps->next, 1, __ATOMIC_RELAXED)) < ps->nr) {
+        if (pscan_count(ps, ps->first + i, buf, &ps->counts[i])) {
+            __atomic_store_n(&ps->error, 1, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    kfree(buf);
+
+    return NULL;
+}
+
+/* the calling thread counts as well */
+static int pscan_window(struct pscan *ps, size_t nr_threads)
+{
+    pthread_t threads[PSCAN_MAX_THREADS];
+    size_t started = 0;
+
+    ps->next = 0;
+    ps->error = 0;
+
+    for (; started + 1 < nr_threads && started + 1 < ps->nr; ++started)
+        if (pthread_create(&threads[started], NULL, pscan_worker, ps))
+            break;
+
+    pscan_worker(ps);
+
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+
+    return ps->error ? -EIO : 0;
+}
+
+static size_t pscan_nr_threads(void)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1)
+        return 1;
+
+    return cpus > PSCAN_MAX_THREADS ? PSCAN_MAX_THREADS : cpus;
+}
+
+int pscan_line_offset(int fd, const char *map, size_t size, size_t nr_lines,
+                      size_t *offset)
+{
+    struct pscan ps = { .fd = fd, .map = map, .size = size };
+    size_t nr_chunks = (size + PSCAN_CHUNK_SIZE - 1) / PSCAN_CHUNK_SIZE;
+    size_t nr_threads = pscan_nr_threads(), window = 1, seen = 0;
+    char *buf = NULL;
+    int ret = 0;
+
+    ASSERT_PARAM_NOT_NULL(offset);
+
+    *offset = 0;
+    if (!nr_lines)
+        return 0;
+
+    ps.counts = kmalloc_array(nr_threads * 4, sizeof(*ps.counts));
+
+    /*
+     * The window starts with a single chunk, so small line numbers are cheap.
+     * Then it grows up to a few chunks per thread.
+     */
+    for (ps.first = 0; ps.first < nr_chunks; ps.first += ps.nr) {
+        ps.nr = nr_chunks - ps.first < window ? nr_chunks - ps.first : window;
+
+        ret = pscan_window(&ps, nr_threads);
+        if (ret)
+            goto out;
+
+        for (size_t i = 0; i < ps.nr; ++i) {
+            size_t chunk = ps.first + i, len = pscan_chunk_len(&ps, chunk);
+            size_t off = chunk * PSCAN_CHUNK_SIZE, end = off + len;
+            size_t step = pscan_block_size(&ps);
+
+            if (seen + ps.counts[i] < nr_lines) {
+                seen += ps.counts[i];
+                continue;
+            }
+
+            /* the line starts within this chunk, its block is searched */
+            if (!map)
+                buf = kmalloc(PSCAN_BLOCK_SIZE);
+            for (; off < end; off += step) {
+                size_t blen = end - off > step ? step : end - off, n;
+                const char *data, *p;
+
+                data = pscan_block(&ps, off, blen, buf);
+                if (!data) {
+                    ret = -EIO;
+                    goto out;
+                }
+
+                n = blen == len ? ps.counts[i] : count_newlines(data, blen);
+                if (seen + n < nr_lines) {
+                    seen += n;
+                    continue;
+                }
+
+                for (p = data; seen < nr_lines; ++seen)
+                    p = scan_newline(p, data + blen - p) + 1;
+                *offset = off + (p - data);
+                goto out;
+            }
+        }
+
+        window = window * 2 > nr_threads * 4 ? nr_threads * 4 : window * 2;
+        if (window < nr_threads)
+            window = nr_threads;
+    }
+
+    /* fewer lines than requested */
+    *offset = size;
+
+out:
+    kfree(buf);
+    kfree(ps.counts);
+
+    return ret;
+}
@@ -17,17 +17,17 @@
  * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#ifndef _CONFIG_H_
-#define _CONFIG_H_
+#ifndef _PSCAN_H_
+#define _PSCAN_H_
 
 #include <stddef.h>
 
-struct config {
-    const char *file;
-    size_t n;
-    int f_flag;
-};
-
-extern struct config config;
+/*
+ * Finds the offset after the nr_lines-th newline of a file. The newlines are
+ * counted in chunks on all cores. map may be NULL, then the file is read via
+ * fd. Sets offset to size if the file has fewer lines.
+ */
+int pscan_line_offset(int fd, const char *map, size_t size, size_t nr_lines,
+                      size_t *offset);
 
-#endif /* _CONFIG_H_ */
+#endif /* _PSCAN_H_ */
@@ -0,0 +1,233 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+
+#include "ring.h"
+
+#include "utils.h"
+
+#define RING_MIN_SIZE  4096
+#define RING_MIN_LINES 64
+
+struct line_ring *ring_init(size_t max_lines, size_t max_bytes)
+{
+    struct line_ring *ring = kzmalloc(sizeof(*ring));
+
+    ring->max_lines = max_lines;
+    ring->max_bytes = max_bytes;
+    ring->size = RING_MIN_SIZE;
+    ring->data = kmalloc(ring->size);
+    ring->cap = max_lines < RING_MIN_LINES ? max_lines : RING_MIN_LINES;
+    ring->lines = kmalloc_array(ring->cap, sizeof(*ring->lines));
+
+    return ring;
+}
+
+void ring_free(struct line_ring *ring)
+{
+    if (!ring)
+        return;
+
+    kfree(ring->data);
+    kfree(ring->lines);
+    kfree(ring);
+}
+
+void ring_reset(struct line_ring *ring)
+{
+    ring->start = 0;
+    ring->used = 0;
+    ring->first = 0;
+    ring->nr = 0;
+    ring->open = 0;
+}
+
+static inline struct ring_entry *ring_entry(const struct line_ring *ring,
+                                            size_t i)
+{
+    return &ring->lines[(ring->first + i) % ring->cap];
+}
+
+/* linearizes the byte ring into a buffer of at least size bytes */
+static void ring_grow_data(struct line_ring *ring, size_t size)
+{
+    size_t new_size = ring->size;
+    size_t head = ring->size - ring->start;
+    char *data;
+
+    while (new_size < size)
+        new_size *= 2;
+    if (ring->max_bytes && size <= ring->max_bytes &&
+        new_size > ring->max_bytes)
+        new_size = ring->max_bytes;
+
+    data = kmalloc(new_size);
+    if (ring->used <= head) {
+        memcpy(data, ring->data + ring->start, ring->used);
+    } else {
+        memcpy(data, ring->data + ring->start, head);
+        memcpy(data + head, ring->data, ring->used - head);
+    }
+
+    for (size_t i = 0; i < ring->nr; ++i) {
+        struct ring_entry *e = ring_entry(ring, i);
+        e->off = (e->off + ring->size - ring->start) % ring->size;
+    }
+
+    kfree(ring->data);
+    ring->data = data;
+    ring->size = new_size;
+    ring->start = 0;
+}
+
+static void ring_grow_lines(struct line_ring *ring)
+{
+    size_t new_cap = ring->cap * 2 > ring->max_lines ?
+        ring->max_lines : ring->cap * 2;
+    struct ring_entry *lines = kmalloc_array(new_cap, sizeof(*lines));
+
+    for (size_t i = 0; i < ring->nr; ++i)
+        lines[i] = *ring_entry(ring, i);
+
+    kfree(ring->lines);
+    ring->lines = lines;
+    ring->cap = new_cap;
+    ring->first = 0;
+}
+
+static void ring_evict(struct line_ring *ring)
+{
+    struct ring_entry *e = ring_entry(ring, 0);
+
+    ring->used -= e->len;
+    ring->first = (ring->first + 1) % ring->cap;
+    ring->nr--;
+    ring->start = ring->nr ? ring_entry(ring, 0)->off : 0;
+    if (!ring->nr)
+        ring->used = 0;
+}
+
+/* makes room for len bytes, whole lines go first */
+static void ring_trim(struct line_ring *ring, size_t len)
+{
+    while (ring->nr && ring->used + len > ring->max_bytes) {
+        struct ring_entry *e = ring_entry(ring, 0);
+        size_t excess = ring->used + len - ring->max_bytes;
+
+        /* the open line is the last one, it's never evicted */
+        if (e->len <= excess && !(ring->nr == 1 && ring->open)) {
+            ring_evict(ring);
+            continue;
+        }
+
+        if (excess > e->len)
+            excess = e->len;
+        ring->cut = 1;
+        e->off = (e->off + excess) % ring->size;
+        e->len -= excess;
+        e->pos += excess;
+        ring->used -= excess;
+        ring->start = e->off;
+    }
+}
+
+void ring_push(struct line_ring *ring, const char *buf, size_t len, size_t pos,
+               int eol)
+{
+    struct ring_entry *e;
+    size_t at, head;
+
+    if (!ring->max_lines || (!len && !eol))
+        return;
+
+    /* only the end of a huge chunk is kept, the open line skips the rest */
+    if (ring->max_bytes && len > ring->max_bytes) {
+        size_t drop = len - ring->max_bytes;
+
+        if (ring->open)
+            ring_entry(ring, ring->nr - 1)->pos += drop;
+        ring->cut = 1;
+        buf += drop;
+        pos += drop;
+        len = ring->max_bytes;
+    }
+
+    if (!ring->open) {
+        if (ring->nr == ring->max_lines)
+            ring_evict(ring);
+        if (ring->nr == ring->cap)
+            ring_grow_lines(ring);
+    }
+
+    if (ring->max_bytes)
+        ring_trim(ring, len);
+    if (ring->used + len > ring->size)
+        ring_grow_data(ring, ring->used + len);
+
+    /* start a new line */
+    if (!ring->open) {
+        e = ring_entry(ring, ring->nr++);
+        e->off = (ring->start + ring->used) % ring->size;
+        e->len = 0;
+        e->pos = pos;
+        ring->open = 1;
+    }
+
+    /* copy, might wrap around */
+    at = (ring->start + ring->used) % ring->size;
+    head = ring->size - at;
+    if (len <= head) {
+        memcpy(ring->data + at, buf, len);
+    } else {
+        memcpy(ring->data + at, buf, head);
+        memcpy(ring->data, buf + head, len - head);
+    }
+
+    e = ring_entry(ring, ring->nr - 1);
+    e->len += len;
+    ring->used += len;
+    ring->open = !eol;
+}
+
+int ring_line(const struct line_ring *ring, size_t i, struct iovec iov[2],
+              size_t *pos)
+{
+    const struct ring_entry *e;
+    size_t head;
+
+    if (i >= ring->nr)
+        return 0;
+
+    e = ring_entry(ring, i);
+    head = ring->size - e->off;
+    *pos = e->pos;
+
+    iov[0].iov_base = ring->data + e->off;
+    if (e->len <= head) {
+        iov[0].iov_len = e->len;
+        return 1;
+    }
+
+    iov[0].iov_len = head;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = e->len - head;
+
+    return 2;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/*
+ * Ring of the last max_lines lines. The lines are packed end to end into a
+ * byte ring, which grows on demand. Therefore, the memory usage is
+ * proportional to the size of the tail and lines of any length are stored.
+ * With max_bytes the ring keeps the last max_bytes bytes at most, the oldest
+ * line is cut at the front if necessary.
+ */
+struct ring_entry {
+    size_t off;
+    size_t len;
+    size_t pos;                 /* offset of the line in the file */
+};
+
+struct line_ring {
+    char *data;
+    size_t size;                /* capacity of data */
+    size_t start;               /* offset of the oldest line in data */
+    size_t used;                /* bytes in use */
+    struct ring_entry *lines;
+    size_t cap;                 /* capacity of lines */
+    size_t first;               /* index of the oldest line */
+    size_t nr;                  /* number of lines */
+    size_t max_lines;
+    size_t max_bytes;           /* 0 for no limit */
+    int cut;                    /* a line has been cut by max_bytes */
+    int open;                   /* last line isn't terminated yet */
+};
+
+struct line_ring *ring_init(size_t max_lines, size_t max_bytes);
+void ring_free(struct line_ring *ring);
+void ring_reset(struct line_ring *ring);
+
+/*
+ * Appends buf, which is at offset pos in the file, to the current line. eol
+ * terminates it.
+ */
+void ring_push(struct line_ring *ring, const char *buf, size_t len, size_t pos,
+               int eol);
+
+/*
+ * Fills iov with line i (0 is the oldest) and pos with its offset in the file.
+ * Returns the number of segments.
+ */
+int ring_line(const struct line_ring *ring, size_t i, struct iovec iov[2],
+              size_t *pos);
+
+#endif /* _RING_H_ */
@@ -0,0 +1,363 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <stdint.h>
+
+#include "scan.h"
+
+#include "ktail_config.h"
+
+#ifdef HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* scalar */
+static const char *scan_newline_scalar(const char *buf, size_t len)
+{
+    return memchr(buf, '\n', len);
+}
+
+static const char *scan_newline_reverse_scalar(const char *buf, size_t len)
+{
+    return memrchr(buf, '\n', len);
+}
+
+static size_t count_newlines_scalar(const char *buf, size_t len)
+{
+    size_t cnt = 0;
+
+    for (size_t i = 0; i < len; ++i)
+        cnt += buf[i] == '\n';
+
+    return cnt;
+}
+
+static const char *scan_substr_scalar(const char *buf, size_t len,
+                                     const char *needle, size_t n)
+{
+    return memmem(buf, len, needle, n);
+}
+
+static const char *scan_any_scalar(const char *buf, size_t len,
+                                   const char *set, size_t n)
+{
+    for (size_t i = 0; i < len; ++i)
+        for (size_t j = 0; j < n; ++j)
+            if (buf[i] == set[j])
+                return buf + i;
+
+    return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+/* sse2 */
+__attribute__((target("sse2")))
+static const char *scan_newline_sse2(const char *buf, size_t len)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask)
+            return buf + i + __builtin_ctz(mask);
+    }
+
+    return scan_newline_scalar(buf + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static const char *scan_newline_reverse_sse2(const char *buf, size_t len)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t i = len;
+
+    for (; i >= 16; i -= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i - 16));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask)
+            return buf + i - 16 + (31 - __builtin_clz(mask));
+    }
+
+    return scan_newline_reverse_scalar(buf, i);
+}
+
+__attribute__((target("sse2")))
+static size_t count_newlines_sse2(const char *buf, size_t len)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    size_t cnt = 0, i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        cnt += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)));
+    }
+
+    return cnt + count_newlines_scalar(buf + i, len - i);
+}
+
+/*
+ * Substring search: blocks of candidate positions are found by comparing the
+ * first and the last byte of the needle at once. Only those are verified.
+ */
+__attribute__((target("sse2")))
+static const char *scan_substr_sse2(const char *buf, size_t len,
+                                   const char *needle, size_t n)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[n - 1]);
+    size_t i = 0;
+
+    if (n < 2 || n > len)
+        return scan_substr_scalar(buf, len, needle, n);
+
+    for (; i + n - 1 + 16 <= len; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + n - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                        _mm_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+
+            if (!memcmp(buf + pos + 1, needle + 1, n - 2))
+                return buf + pos;
+            mask &= mask - 1;
+        }
+    }
+
+    return scan_substr_scalar(buf + i, len - i, needle, n);
+}
+
+/* unused entries of set repeat the first one */
+__attribute__((target("sse2")))
+static const char *scan_any_sse2(const char *buf, size_t len, const char *set,
+                                 size_t n)
+{
+    const __m128i c0 = _mm_set1_epi8(set[0]);
+    const __m128i c1 = _mm_set1_epi8(set[n > 1 ? 1 : 0]);
+    const __m128i c2 = _mm_set1_epi8(set[n > 2 ? 2 : 0]);
+    const __m128i c3 = _mm_set1_epi8(set[n > 3 ? 3 : 0]);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i eq = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, c0),
+                                               _mm_cmpeq_epi8(v, c1)),
+                                  _mm_or_si128(_mm_cmpeq_epi8(v, c2),
+                                               _mm_cmpeq_epi8(v, c3)));
+        unsigned mask = _mm_movemask_epi8(eq);
+        if (mask)
+            return buf + i + __builtin_ctz(mask);
+    }
+
+    return scan_any_scalar(buf + i, len - i, set, n);
+}
+
+/* avx2 */
+__attribute__((target("avx2")))
+static const char *scan_newline_avx2(const char *buf, size_t len)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (mask)
+            return buf + i + __builtin_ctz(mask);
+    }
+
+    return scan_newline_sse2(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_newline_reverse_avx2(const char *buf, size_t len)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t i = len;
+
+    for (; i >= 32; i -= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i - 32));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (mask)
+            return buf + i - 32 + (31 - __builtin_clz(mask));
+    }
+
+    return scan_newline_reverse_sse2(buf, i);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t count_newlines_avx2(const char *buf, size_t len)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    size_t cnt = 0, i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        cnt += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl)));
+    }
+
+    return cnt + count_newlines_sse2(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_substr_avx2(const char *buf, size_t len,
+                                   const char *needle, size_t n)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[n - 1]);
+    size_t i = 0;
+
+    if (n < 2 || n > len)
+        return scan_substr_scalar(buf, len, needle, n);
+
+    for (; i + n - 1 + 32 <= len; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(buf + i + n - 1));
+        unsigned mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                             _mm256_cmpeq_epi8(b, last)));
+
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+
+            if (!memcmp(buf + pos + 1, needle + 1, n - 2))
+                return buf + pos;
+            mask &= mask - 1;
+        }
+    }
+
+    return scan_substr_sse2(buf + i, len - i, needle, n);
+}
+
+__attribute__((target("avx2")))
+static const char *scan_any_avx2(const char *buf, size_t len, const char *set,
+                                 size_t n)
+{
+    const __m256i c0 = _mm256_set1_epi8(set[0]);
+    const __m256i c1 = _mm256_set1_epi8(set[n > 1 ? 1 : 0]);
+    const __m256i c2 = _mm256_set1_epi8(set[n > 2 ? 2 : 0]);
+    const __m256i c3 = _mm256_set1_epi8(set[n > 3 ? 3 : 0]);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i eq = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, c0),
+                                                     _mm256_cmpeq_epi8(v, c1)),
+                                     _mm256_or_si256(_mm256_cmpeq_epi8(v, c2),
+                                                     _mm256_cmpeq_epi8(v, c3)));
+        unsigned mask = _mm256_movemask_epi8(eq);
+        if (mask)
+            return buf + i + __builtin_ctz(mask);
+    }
+
+    return scan_any_sse2(buf + i, len - i, set, n);
+}
+
+/* avx-512 */
+__attribute__((target("avx512f,avx512bw")))
+static const char *scan_newline_avx512(const char *buf, size_t len)
+{
+    const __m512i nl = _mm512_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(buf + i));
+        uint64_t mask = _mm512_cmpeq_epi8_mask(v, nl);
+        if (mask)
+            return buf + i + __builtin_ctzll(mask);
+    }
+
+    return scan_newline_avx2(buf + i, len - i);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static const char *scan_newline_reverse_avx512(const char *buf, size_t len)
+{
+    const __m512i nl = _mm512_set1_epi8('\n');
+    size_t i = len;
+
+    for (; i >= 64; i -= 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(buf + i - 64));
+        uint64_t mask = _mm512_cmpeq_epi8_mask(v, nl);
+        if (mask)
+            return buf + i - 64 + (63 - __builtin_clzll(mask));
+    }
+
+    return scan_newline_reverse_avx2(buf, i);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt")))
+static size_t count_newlines_avx512(const char *buf, size_t len)
+{
+    const __m512i nl = _mm512_set1_epi8('\n');
+    size_t cnt = 0, i = 0;
+
+    for (; i + 64 <= len; i += 64) {
+        __m512i v = _mm512_loadu_si512((const void *)(buf + i));
+        cnt += __builtin_popcountll(_mm512_cmpeq_epi8_mask(v, nl));
+    }
+
+    return cnt + count_newlines_avx2(buf + i, len - i);
+}
+#endif
+
+const char *(*scan_newline)(const char *buf, size_t len) = scan_newline_scalar;
+const char *(*scan_newline_reverse)(const char *buf, size_t len) = scan_newline_reverse_scalar;
+size_t (*count_newlines)(const char *buf, size_t len) = count_newlines_scalar;
+const char *(*scan_substr)(const char *buf, size_t len, const char *needle,
+                           size_t n) = scan_substr_scalar;
+const char *(*scan_any)(const char *buf, size_t len, const char *set,
+                        size_t n) = scan_any_scalar;
+
+__attribute__((constructor)) static void init(void)
+{
+#ifdef HAVE_X86_SIMD
+    int popcnt;
+
+    __builtin_cpu_init();
+    /* the counting kernels use popcnt, which AVX2 doesn't imply */
+    popcnt = __builtin_cpu_supports("popcnt");
+
+    if (__builtin_cpu_supports("avx512bw")) {
+        scan_newline = scan_newline_avx512;
+        scan_newline_reverse = scan_newline_reverse_avx512;
+        count_newlines = popcnt ? count_newlines_avx512 : count_newlines_sse2;
+        scan_substr = scan_substr_avx2;
+        scan_any = scan_any_avx2;
+    } else if (__builtin_cpu_supports("avx2")) {
+        scan_newline = scan_newline_avx2;
+        scan_newline_reverse = scan_newline_reverse_avx2;
+        count_newlines = popcnt ? count_newlines_avx2 : count_newlines_sse2;
+        scan_substr = scan_substr_avx2;
+        scan_any = scan_any_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        scan_newline = scan_newline_sse2;
+        scan_newline_reverse = scan_newline_reverse_sse2;
+        count_newlines = count_newlines_sse2;
+        scan_substr = scan_substr_sse2;
+        scan_any = scan_any_sse2;
+    }
+#endif
+}
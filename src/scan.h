@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+/*
+ * Newline and substring scanning kernels. The fastest variant supported by the
+ * CPU is selected once at startup.
+ */
+extern const char *(*scan_newline)(const char *buf, size_t len);
+extern const char *(*scan_newline_reverse)(const char *buf, size_t len);
+extern size_t (*count_newlines)(const char *buf, size_t len);
+/* like memmem(), the avx-512 variant uses the avx2 kernel */
+extern const char *(*scan_substr)(const char *buf, size_t len,
+                                  const char *needle, size_t n);
+/* first byte, which is one of the n <= 4 bytes in set */
+extern const char *(*scan_any)(const char *buf, size_t len, const char *set,
+                               size_t n);
+
+#endif /* _SCAN_H_ */
@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#include "state.h"
+
+#include "ktail.h"
+#include "utils.h"
+
+/* seconds between two writes of the state file */
+#define STATE_INTERVAL 1
+
+struct state_entry {
+    char *path;
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long offset;
+    size_t hash;                /* of the path */
+    /* context of the followed file, if any */
+    struct ktail_context *ctx;
+};
+
+struct state {
+    const char *file;
+    struct state_entry *entries;
+    size_t nr, cap;
+    /* entries by path, as index + 1, kept at most half full */
+    size_t *index;
+    size_t index_cap;
+    time_t last_save;
+    int dirty;
+};
+
+static void state_index_put(struct state *state, size_t idx)
+{
+    size_t mask = state->index_cap - 1, i = state->entries[idx].hash & mask;
+
+    while (state->index[i])
+        i = (i + 1) & mask;
+    state->index[i] = idx + 1;
+}
+
+/* entries are never removed, so the index only grows */
+static void state_index_grow(struct state *state)
+{
+    kfree(state->index);
+    state->index_cap = state->index_cap ? state->index_cap * 2 : 32;
+    state->index = kzmalloc_array(state->index_cap, sizeof(*state->index));
+    for (size_t i = 0; i < state->nr; ++i)
+        state_index_put(state, i);
+}
+
+static struct state_entry *state_add(struct state *state, const char *path)
+{
+    struct state_entry *entry;
+
+    if ((state->nr + 1) * 2 > state->index_cap)
+        state_index_grow(state);
+
+    if (state->nr == state->cap) {
+        struct state_entry *entries;
+
+        state->cap = state->cap ? state->cap * 2 : 16;
+        entries = kzmalloc_array(state->cap, sizeof(*entries));
+        if (state->nr)
+            memcpy(entries, state->entries, state->nr * sizeof(*entries));
+        kfree(state->entries);
+        state->entries = entries;
+    }
+
+    entry = &state->entries[state->nr];
+    entry->path = kmalloc(strlen(path) + 1);
+    strcpy(entry->path, path);
+    entry->hash = path_hash(path);
+    state_index_put(state, state->nr++);
+
+    return entry;
+}
+
+static struct state_entry *state_find(struct state *state, const char *path)
+{
+    size_t hash = path_hash(path), mask = state->index_cap - 1;
+
+    if (!state->nr)
+        return NULL;
+
+    for (size_t i = hash & mask; state->index[i]; i = (i + 1) & mask) {
+        struct state_entry *entry = &state->entries[state->index[i] - 1];
+
+        if (entry->hash == hash && !strcmp(entry->path, path))
+            return entry;
+    }
+
+    return NULL;
+}
+
+static time_t state_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec;
+}
+
+/* one line per file: <dev> <inode> <offset> <path> */
+struct state *state_load(const char *file)
+{
+    struct state *state = kzmalloc(sizeof(*state));
+    char line[PATH_MAX + 64];
+    size_t nr = 0;
+    FILE *fp;
+
+    state->file = file;
+    state->last_save = state_now();
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        if (errno != ENOENT)
+            warn_errno("Failed to open state file '%s'", file);
+        return state;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        unsigned long long dev, ino, offset;
+        struct state_entry *entry;
+        size_t len = strlen(line);
+        int pos;
+
+        nr++;
+        if (!len || line[len - 1] != '\n' ||
+            sscanf(line, "%llu %llu %llu %n", &dev, &ino, &offset, &pos) != 3 ||
+            line[pos] == '\n') {
+            warn("Ignoring malformed line %zu of state file '%s'", nr, file);
+            continue;
+        }
+        line[len - 1] = '\0';
+
+        if (state_find(state, line + pos))
+            continue;
+
+        entry = state_add(state, line + pos);
+        entry->dev = dev;
+        entry->ino = ino;
+        entry->offset = offset;
+    }
+
+    fclose(fp);
+
+    return state;
+}
+
+void state_free(struct state *state)
+{
+    if (!state)
+        return;
+
+    for (size_t i = 0; i < state->nr; ++i)
+        kfree(state->entries[i].path);
+    kfree(state->entries);
+    kfree(state->index);
+    kfree(state);
+}
+
+int state_attach(struct state *state, struct ktail_context *ctx)
+{
+    struct state_entry *entry;
+
+    ASSERT_PARAM_NOT_NULL(state);
+    ASSERT_PARAM_NOT_NULL(ctx);
+
+    /* the offset of pipes and standard input is meaningless */
+    if (ctx->engine == KTAIL_ENGINE_STREAM || ktail_is_stdin(ctx->file) ||
+        strchr(ctx->file, '\n'))
+        return 0;
+
+    state->dirty = 1;
+
+    entry = state_find(state, ctx->file);
+    if (!entry) {
+        entry = state_add(state, ctx->file);
+        entry->ctx = ctx;
+        return 0;
+    }
+    entry->ctx = ctx;
+
+    /* everything of a file, which replaced the known one, is new */
+    if (entry->dev != (unsigned long long)ctx->dev ||
+        entry->ino != (unsigned long long)ctx->ino) {
+        warn("File '%s' has been replaced since the last run", ctx->file);
+        ctx->bytes = 0;
+    } else if (entry->offset > ctx->size) {
+        warn("File '%s' truncated since the last run", ctx->file);
+        ctx->bytes = 0;
+    } else {
+        ctx->bytes = entry->offset;
+    }
+
+    return 1;
+}
+
+static void state_entry_update(struct state *state, struct state_entry *entry)
+{
+    const struct ktail_context *ctx = entry->ctx;
+
+    if (entry->dev == (unsigned long long)ctx->dev &&
+        entry->ino == (unsigned long long)ctx->ino &&
+        entry->offset == ctx->bytes)
+        return;
+
+    entry->dev = ctx->dev;
+    entry->ino = ctx->ino;
+    entry->offset = ctx->bytes;
+    state->dirty = 1;
+}
+
+void state_detach(struct state *state, struct ktail_context *ctx)
+{
+    struct state_entry *entry;
+
+    ASSERT_PARAM_NOT_NULL_VOID(state);
+    ASSERT_PARAM_NOT_NULL_VOID(ctx);
+
+    /* the entry is another context's, if the path has been given twice */
+    entry = state_find(state, ctx->file);
+    if (!entry || entry->ctx != ctx)
+        return;
+
+    state_entry_update(state, entry);
+    entry->ctx = NULL;
+}
+
+/* the new state replaces the old one by rename(), so it's never torn */
+static int state_write(const struct state *state)
+{
+    char tmp[PATH_MAX];
+    FILE *fp;
+    int ret = -EIO;
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", state->file) >= (int)sizeof(tmp)) {
+        print_err("Path of state file '%s' is too long", state->file);
+        return -ENAMETOOLONG;
+    }
+
+    fp = fopen(tmp, "w");
+    if (!fp) {
+        print_err_errno("Failed to open '%s'", tmp);
+        return -EIO;
+    }
+
+    for (size_t i = 0; i < state->nr; ++i) {
+        const struct state_entry *entry = &state->entries[i];
+
+        fprintf(fp, "%llu %llu %llu %s\n", entry->dev, entry->ino,
+                entry->offset, entry->path);
+    }
+
+    if (fflush(fp) || fdatasync(fileno(fp))) {
+        print_err_errno("Failed to write '%s'", tmp);
+        goto out;
+    }
+
+    if (rename(tmp, state->file)) {
+        print_err_errno("Failed to rename '%s' to '%s'", tmp, state->file);
+        goto out;
+    }
+
+    ret = 0;
+
+out:
+    if (fclose(fp) && !ret) {
+        print_err_errno("Failed to write '%s'", tmp);
+        ret = -EIO;
+    }
+    if (ret)
+        unlink(tmp);
+
+    return ret;
+}
+
+int state_save(struct state *state, int force)
+{
+    time_t now;
+
+    ASSERT_PARAM_NOT_NULL(state);
+
+    now = state_now();
+    if (!force && now - state->last_save < STATE_INTERVAL)
+        return 0;
+
+    for (size_t i = 0; i < state->nr; ++i)
+        if (state->entries[i].ctx)
+            state_entry_update(state, &state->entries[i]);
+
+    if (!state->dirty)
+        return 0;
+
+    state->last_save = now;
+    if (state_write(state))
+        return -EIO;
+    state->dirty = 0;
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATE_H_
+#define _STATE_H_
+
+#include <stddef.h>
+
+struct ktail_context;
+struct state;
+
+/*
+ * Checkpoints of the followed files. For each path the device, inode and
+ * printed offset are recorded, so a restarted ktail continues where it stopped.
+ */
+struct state *state_load(const char *file);
+void state_free(struct state *state);
+
+/*
+ * Binds ctx to its checkpoint. Returns 1 if ctx->bytes has been set to the
+ * offset to resume from, 0 if the file is new.
+ */
+int state_attach(struct state *state, struct ktail_context *ctx);
+/* records the final offset of ctx before it's freed */
+void state_detach(struct state *state, struct ktail_context *ctx);
+
+/* writes the checkpoints atomically, at most once a second unless forced */
+int state_save(struct state *state, int force);
+
+#endif /* _STATE_H_ */
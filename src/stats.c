@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "stats.h"
+
+#include "ktail.h"
+#include "utils.h"
+#include "tstamp.h"
+
+unsigned long long stats_now(const struct stats *s)
+{
+    struct timespec ts;
+
+    if (!s)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* bucket i holds [2^(i-1), 2^i) usec, bucket 0 everything below 1 usec */
+void stats_hist_add(unsigned long long *hist, unsigned long long ns)
+{
+    unsigned long long usec = ns / 1000;
+    int bucket = usec ? 64 - __builtin_clzll(usec) : 0;
+
+    hist[bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1]++;
+}
+
+void stats_stamp(struct stats *s, const struct ktail_context *ctx, size_t off)
+{
+    char buf[TSTAMP_MAX_LEN];
+    struct timespec stamp, now;
+    long long ns;
+    ssize_t rc;
+
+    rc = pread_full(ctx->fd, buf, sizeof(buf), off);
+    STATS_INC(s, syscalls);
+    if (rc <= 0 || tstamp_parse_ts(buf, rc, &stamp))
+        return;
+
+    /* clock skew between writer and ktail counts as no delay */
+    clock_gettime(CLOCK_REALTIME, &now);
+    ns = (now.tv_sec - stamp.tv_sec) * 1000000000LL + now.tv_nsec - stamp.tv_nsec;
+    stats_hist_add(s->stamp_hist, ns > 0 ? ns : 0);
+}
+
+static void stats_dump_hist(FILE *fp, const char *name,
+                            const unsigned long long *hist)
+{
+    fprintf(fp, "  %s (usec):\n", name);
+
+    for (int i = 0; i < STATS_BUCKETS; ++i) {
+        unsigned long long lo = i ? 1ULL << (i - 1) : 0;
+
+        if (!hist[i])
+            continue;
+        if (i == STATS_BUCKETS - 1)
+            fprintf(fp, "    [%10llu,        inf): %llu\n", lo, hist[i]);
+        else
+            fprintf(fp, "    [%10llu, %10llu): %llu\n", lo, 1ULL << i, hist[i]);
+    }
+}
+
+void stats_dump(const struct stats *s, FILE *fp)
+{
+    fprintf(fp, "ktail stats:\n");
+    fprintf(fp, "  wakeups: %llu\n", s->wakeups);
+    fprintf(fp, "  syscalls: %llu\n", s->syscalls);
+    fprintf(fp, "  bytes read: %llu\n", s->bytes_read);
+    fprintf(fp, "  bytes written: %llu\n", s->bytes_written);
+    fprintf(fp, "  reopens: %llu\n", s->reopens);
+    fprintf(fp, "  rotations: %llu\n", s->rotations);
+    fprintf(fp, "  truncations: %llu\n", s->truncations);
+    fprintf(fp, "  wait time: %.6f s\n", s->wait_ns / 1e9);
+    fprintf(fp, "  read/print time: %.6f s\n", s->print_ns / 1e9);
+    stats_dump_hist(fp, "wakeup to flush", s->flush_hist);
+    if (s->stamps)
+        stats_dump_hist(fp, "line timestamp to flush", s->stamp_hist);
+    fflush(fp);
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdio.h>
+#include <stddef.h>
+
+struct ktail_context;
+
+/* log2 buckets of microseconds, the last one takes everything above */
+#define STATS_BUCKETS 32
+
+/*
+ * Counters of the read, print and wait paths. They're kept per instance, a
+ * NULL pointer turns them off. Only the timing reads the clock.
+ */
+struct stats {
+    unsigned long long wakeups;
+    unsigned long long syscalls;
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long reopens;
+    unsigned long long rotations;
+    unsigned long long truncations;
+    unsigned long long wait_ns;
+    unsigned long long print_ns;
+    /* from the return of the wait until the data is written */
+    unsigned long long flush_hist[STATS_BUCKETS];
+    /* from the timestamp of the first new line until it's written */
+    unsigned long long stamp_hist[STATS_BUCKETS];
+    /* also sample the line timestamps */
+    int stamps;
+};
+
+#define STATS_INC(s, field)                     \
+    do {                                        \
+        if (s)                                  \
+            (s)->field++;                       \
+    } while (0)
+#define STATS_ADD(s, field, n)                  \
+    do {                                        \
+        if (s)                                  \
+            (s)->field += (n);                  \
+    } while (0)
+
+/* monotonic time in ns, 0 without stats so that no clock is read */
+unsigned long long stats_now(const struct stats *s);
+void stats_hist_add(unsigned long long *hist, unsigned long long ns);
+/* parses the timestamp of the line at off and records its age */
+void stats_stamp(struct stats *s, const struct ktail_context *ctx, size_t off);
+void stats_dump(const struct stats *s, FILE *fp);
+
+#endif /* _STATS_H_ */
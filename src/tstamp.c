@@ -0,0 +1,260 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tstamp.h"
+
+#include "utils.h"
+
+static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+static int tstamp_digits(const char *p, int nr)
+{
+    int res = 0;
+
+    for (int i = 0; i < nr; ++i) {
+        if (p[i] < '0' || p[i] > '9')
+            return -1;
+        res = res * 10 + p[i] - '0';
+    }
+
+    return res;
+}
+
+/* HH:MM[:SS], returns the parsed length or 0 */
+static size_t tstamp_time(const char *p, size_t len, struct tm *tm)
+{
+    if (len < 5 || p[2] != ':')
+        return 0;
+
+    tm->tm_hour = tstamp_digits(p, 2);
+    tm->tm_min = tstamp_digits(p + 3, 2);
+    tm->tm_sec = 0;
+    if (tm->tm_hour < 0 || tm->tm_hour > 23 || tm->tm_min < 0 ||
+        tm->tm_min > 59)
+        return 0;
+
+    if (len < 8 || p[5] != ':')
+        return 5;
+
+    tm->tm_sec = tstamp_digits(p + 6, 2);
+    if (tm->tm_sec < 0 || tm->tm_sec > 60)
+        return 0;
+
+    return 8;
+}
+
+/* YYYY-MM-DD */
+static size_t tstamp_date(const char *p, size_t len, struct tm *tm)
+{
+    int year, mon, day;
+
+    if (len < 10 || p[4] != '-' || p[7] != '-')
+        return 0;
+
+    year = tstamp_digits(p, 4);
+    mon = tstamp_digits(p + 5, 2);
+    day = tstamp_digits(p + 8, 2);
+    if (year < 1970 || mon < 1 || mon > 12 || day < 1 || day > 31)
+        return 0;
+
+    tm->tm_year = year - 1900;
+    tm->tm_mon = mon - 1;
+    tm->tm_mday = day;
+
+    return 10;
+}
+
+/* Z, +HH, +HHMM or +HH:MM as seconds east of UTC */
+static size_t tstamp_zone(const char *p, size_t len, long *off)
+{
+    int hours, mins = 0;
+    size_t i = 3;
+
+    if (len && *p == 'Z') {
+        *off = 0;
+        return 1;
+    }
+    if (len < 3 || (*p != '+' && *p != '-'))
+        return 0;
+
+    hours = tstamp_digits(p + 1, 2);
+    if (hours < 0)
+        return 0;
+    if (len >= 6 && p[3] == ':' && tstamp_digits(p + 4, 2) >= 0) {
+        mins = tstamp_digits(p + 4, 2);
+        i = 6;
+    } else if (len >= 5 && tstamp_digits(p + 3, 2) >= 0) {
+        mins = tstamp_digits(p + 3, 2);
+        i = 5;
+    }
+
+    *off = (hours * 60L + mins) * 60;
+    if (*p == '-')
+        *off = -*off;
+
+    return i;
+}
+
+static time_t tstamp_local(struct tm *tm)
+{
+    tm->tm_isdst = -1;
+
+    return mktime(tm);
+}
+
+/* returns the parsed length or 0, nsec may be NULL */
+static size_t tstamp_iso(const char *p, size_t len, time_t *t, long *nsec)
+{
+    struct tm tm = { .tm_sec = 0 };
+    long off, frac = 0, scale = 1000000000;
+    size_t i, n;
+
+    if (!tstamp_date(p, len, &tm) || len < 11 || (p[10] != 'T' && p[10] != ' '))
+        return 0;
+    n = tstamp_time(p + 11, len - 11, &tm);
+    if (!n)
+        return 0;
+    i = 11 + n;
+
+    /* digits beyond nanoseconds are ignored */
+    if (i < len && (p[i] == '.' || p[i] == ',')) {
+        for (++i; i < len && p[i] >= '0' && p[i] <= '9'; ++i) {
+            if (scale == 1)
+                continue;
+            scale /= 10;
+            frac += (p[i] - '0') * scale;
+        }
+    }
+    if (nsec)
+        *nsec = frac;
+
+    n = tstamp_zone(p + i, len - i, &off);
+    if (n) {
+        *t = timegm(&tm) - off;
+        return i + n;
+    }
+    *t = tstamp_local(&tm);
+
+    return i;
+}
+
+/*
+ * Syslog omits the year. The current one is assumed, unless the timestamp would
+ * be in the future, e.g. December entries read in January.
+ */
+static size_t tstamp_syslog(const char *p, size_t len, time_t *t)
+{
+    struct tm tm = { .tm_sec = 0 }, now_tm;
+    const char *mon;
+    time_t now;
+    int day;
+
+    if (len < 15 || p[3] != ' ' || p[6] != ' ')
+        return 0;
+    for (mon = months; *mon; mon += 3)
+        if (!strncmp(mon, p, 3))
+            break;
+    if (!*mon)
+        return 0;
+
+    day = p[4] == ' ' ? tstamp_digits(p + 5, 1) : tstamp_digits(p + 4, 2);
+    if (day < 1 || day > 31 || tstamp_time(p + 7, len - 7, &tm) != 8)
+        return 0;
+
+    now = time(NULL);
+    localtime_r(&now, &now_tm);
+    tm.tm_year = now_tm.tm_year;
+    tm.tm_mon = (mon - months) / 3;
+    tm.tm_mday = day;
+    *t = tstamp_local(&tm);
+    if (*t > now + 24 * 60 * 60) {
+        tm.tm_year--;
+        *t = tstamp_local(&tm);
+    }
+
+    return 15;
+}
+
+int tstamp_parse_ts(const char *buf, size_t len, struct timespec *ts)
+{
+    ASSERT_PARAM_NOT_NULL(buf);
+    ASSERT_PARAM_NOT_NULL(ts);
+
+    if (len && *buf == '[') {
+        buf++;
+        len--;
+    }
+
+    if (tstamp_iso(buf, len, &ts->tv_sec, &ts->tv_nsec))
+        return 0;
+    ts->tv_nsec = 0;
+    if (tstamp_syslog(buf, len, &ts->tv_sec))
+        return 0;
+
+    return -EINVAL;
+}
+
+int tstamp_parse(const char *buf, size_t len, time_t *t)
+{
+    struct timespec ts;
+    int ret;
+
+    ASSERT_PARAM_NOT_NULL(t);
+
+    ret = tstamp_parse_ts(buf, len, &ts);
+    if (!ret)
+        *t = ts.tv_sec;
+
+    return ret;
+}
+
+int tstamp_parse_arg(const char *str, time_t *t)
+{
+    struct tm tm;
+    size_t len;
+    time_t now;
+
+    ASSERT_PARAM_NOT_NULL(str);
+    ASSERT_PARAM_NOT_NULL(t);
+
+    len = strlen(str);
+    if (!len)
+        return -EINVAL;
+    if (tstamp_iso(str, len, t, NULL) == len || tstamp_syslog(str, len, t) == len)
+        return 0;
+
+    now = time(NULL);
+    localtime_r(&now, &tm);
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+
+    if ((len == 10 && tstamp_date(str, len, &tm) == len) ||
+        ((len == 5 || len == 8) && tstamp_time(str, len, &tm) == len)) {
+        *t = tstamp_local(&tm);
+        return 0;
+    }
+
+    return -EINVAL;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _TSTAMP_H_
+#define _TSTAMP_H_
+
+#include <stddef.h>
+#include <time.h>
+
+/* a timestamp is expected within the first bytes of a line */
+#define TSTAMP_MAX_LEN 64
+
+/*
+ * Parses the timestamp at the start of a line, either ISO-8601
+ * (2016-05-01T14:05:00[.123][Z|+02:00], the T may be a space) or syslog
+ * (May  1 14:05:00). An opening bracket is skipped. Timestamps without a zone
+ * are local time, syslog ones are in the current year.
+ */
+int tstamp_parse(const char *buf, size_t len, time_t *t);
+
+/* same with the fraction of a second of ISO-8601 timestamps */
+int tstamp_parse_ts(const char *buf, size_t len, struct timespec *ts);
+
+/* like tstamp_parse(), also accepts a date (2016-05-01) or a time of today (14:05) */
+int tstamp_parse_arg(const char *str, time_t *t);
+
+#endif /* _TSTAMP_H_ */
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "uring.h"
+
+#include "stats.h"
+#include "utils.h"
+
+struct uring {
+    int fd;
+    unsigned entries;
+    struct stats *stats;
+    unsigned queued;
+    unsigned inflight;
+    /* submission queue */
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    /* completion queue */
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+struct uring *uring_init(unsigned entries, struct stats *stats)
+{
+    struct io_uring_params p;
+    struct uring *ring;
+    char *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    ring = kzmalloc(sizeof(*ring));
+    ring->stats = stats;
+
+    ring->fd = io_uring_setup(entries, &p);
+    if (ring->fd < 0)
+        goto err0;
+
+    /* writes to the output use the file position */
+    if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+        errno = ENOSYS;
+        goto err1;
+    }
+
+    ring->entries = p.sq_entries;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr == MAP_FAILED)
+        goto err1;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring->fd,
+                            IORING_OFF_CQ_RING);
+        if (ring->cq_ptr == MAP_FAILED)
+            goto err2;
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto err3;
+
+    sq = ring->sq_ptr;
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+
+    cq = ring->cq_ptr;
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return ring;
+
+err3:
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+err2:
+    munmap(ring->sq_ptr, ring->sq_size);
+err1:
+    close(ring->fd);
+err0:
+    kfree(ring);
+
+    return NULL;
+}
+
+void uring_free(struct uring *ring)
+{
+    if (!ring)
+        return;
+
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->fd);
+    kfree(ring);
+}
+
+unsigned uring_space(const struct uring *ring)
+{
+    return ring->entries - ring->queued;
+}
+
+static void uring_prep_rw(struct uring *ring, int op, int fd, const void *buf,
+                          size_t len, uint64_t off, uint64_t user_data,
+                          int link)
+{
+    unsigned tail = *ring->sq_tail + ring->queued;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = user_data;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+
+    ring->sq_array[idx] = idx;
+    ring->queued++;
+}
+
+void uring_prep_read(struct uring *ring, int fd, void *buf, size_t len,
+                     uint64_t off, uint64_t user_data, int link)
+{
+    uring_prep_rw(ring, IORING_OP_READ, fd, buf, len, off, user_data, link);
+}
+
+void uring_prep_write(struct uring *ring, int fd, const void *buf, size_t len,
+                      uint64_t off, uint64_t user_data, int link)
+{
+    uring_prep_rw(ring, IORING_OP_WRITE, fd, buf, len, off, user_data, link);
+}
+
+int uring_submit_and_wait(struct uring *ring)
+{
+    unsigned submit = ring->queued;
+    int rc;
+
+    if (!submit)
+        return 0;
+
+    /* the chain ends with the last entry */
+    ring->sqes[(*ring->sq_tail + submit - 1) & *ring->sq_mask].flags &=
+        ~IOSQE_IO_LINK;
+
+    /* publish the entries to the kernel */
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + submit, __ATOMIC_RELEASE);
+    ring->queued = 0;
+    ring->inflight += submit;
+
+    while (ring->inflight) {
+        unsigned ready = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) -
+            *ring->cq_head;
+
+        if (ready >= ring->inflight && !submit)
+            break;
+
+        rc = io_uring_enter(ring->fd, submit, ring->inflight - ready,
+                            IORING_ENTER_GETEVENTS);
+        STATS_INC(ring->stats, syscalls);
+        if (rc < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            return -errno;
+        }
+        submit -= rc < (int)submit ? (unsigned)rc : submit;
+    }
+
+    return 0;
+}
+
+int uring_reap(struct uring *ring, uint64_t *user_data, int32_t *res)
+{
+    unsigned head = *ring->cq_head;
+    struct io_uring_cqe *cqe;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        return -EAGAIN;
+
+    cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    if (ring->inflight)
+        ring->inflight--;
+
+    return 0;
+}
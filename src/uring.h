@@ -0,0 +1,52 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal io_uring wrapper on top of the raw syscalls, so liburing isn't
+ * needed.
+ */
+struct uring;
+struct stats;
+
+/* returns NULL if io_uring isn't available or disabled, stats may be NULL */
+struct uring *uring_init(unsigned entries, struct stats *stats);
+void uring_free(struct uring *ring);
+
+/* number of free submission queue entries */
+unsigned uring_space(const struct uring *ring);
+
+/* queue a read/write, link chains it to the following one */
+void uring_prep_read(struct uring *ring, int fd, void *buf, size_t len,
+                     uint64_t off, uint64_t user_data, int link);
+void uring_prep_write(struct uring *ring, int fd, const void *buf, size_t len,
+                      uint64_t off, uint64_t user_data, int link);
+
+/* submits all queued entries and waits for all of their completions */
+int uring_submit_and_wait(struct uring *ring);
+
+/* returns 0 and fills the next completion, or -EAGAIN if there is none */
+int uring_reap(struct uring *ring, uint64_t *user_data, int32_t *res);
+
+#endif /* _URING_H_ */
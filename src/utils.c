@@ -19,6 +19,7 @@
 
 #include <stdlib.h>
 #include <limits.h>
+#include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <stdint.h>
@@ -98,6 +99,65 @@ int kstrtol(const char *str, int base, long *res)
     return 0;
 }
 
+ssize_t pread_full(int fd, char *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t rc = pread(fd, buf + done, len - done, off + done);
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (rc == 0)
+            break;
+        done += rc;
+    }
+
+    return done;
+}
+
+int path_dirname(const char *path, char *buf, size_t size)
+{
+    const char *slash = strrchr(path, '/');
+    size_t len;
+
+    if (!slash) {
+        path = ".";
+        len = 1;
+    } else {
+        len = slash == path ? 1 : (size_t)(slash - path);
+    }
+
+    if (len >= size)
+        return -ENAMETOOLONG;
+
+    memcpy(buf, path, len);
+    buf[len] = '\0';
+
+    return 0;
+}
+
+const char *path_basename(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    return slash ? slash + 1 : path;
+}
+
+size_t path_hash(const char *name)
+{
+    size_t hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
 void _log(const char *restrict level, int die, int with_errno,
           const char *restrict file, int line, const char *restrict fmt, ...)
 {
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <errno.h>
 #include <libgen.h>
+#include <sys/types.h>
 
 /* asserts */
 #define ASSERT_PARAM_NOT_NULL(param)                                \
@@ -60,6 +61,15 @@ void _free(void **ptr);
 /* conversion */
 int kstrtol(const char *str, int base, long *res);
 
+/* io, reads less than len only at EOF */
+ssize_t pread_full(int fd, char *buf, size_t len, off_t off);
+
+/* paths, unlike libgen these don't modify their argument */
+int path_dirname(const char *path, char *buf, size_t size);
+const char *path_basename(const char *path);
+/* FNV-1a of a name, for hash tables */
+size_t path_hash(const char *name);
+
 /* logging */
 #define err(...)                                                        \
     do {                                                                \
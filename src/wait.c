@@ -0,0 +1,304 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+
+#include "wait.h"
+
+#include "ktail.h"
+#include "stats.h"
+#include "utils.h"
+
+#if defined(HAVE_EPOLL) && defined(HAVE_INOTIFY)
+extern const struct wait_backend wait_epoll;
+#endif
+#ifdef HAVE_KQUEUE
+extern const struct wait_backend wait_kqueue;
+#endif
+#ifdef HAVE_INOTIFY
+extern const struct wait_backend wait_inotify;
+#endif
+extern const struct wait_backend wait_poll;
+
+const struct wait_backend *const wait_backends[] = {
+#if defined(HAVE_EPOLL) && defined(HAVE_INOTIFY)
+    &wait_epoll,
+#endif
+#ifdef HAVE_KQUEUE
+    &wait_kqueue,
+#endif
+#ifdef HAVE_INOTIFY
+    &wait_inotify,
+#endif
+    &wait_poll,
+    NULL
+};
+
+const struct wait_backend *wait_backend_find(const char *name)
+{
+    if (!name)
+        return wait_backends[0];
+
+    for (int i = 0; wait_backends[i]; ++i)
+        if (!strcmp(wait_backends[i]->name, name))
+            return wait_backends[i];
+
+    return NULL;
+}
+
+struct watcher *watcher_init(const struct ktail_options *opts)
+{
+    const struct wait_backend *backend = wait_backend_find(opts->backend);
+    struct watcher *w;
+
+    if (!backend) {
+        print_err("Unknown wait backend '%s'", opts->backend);
+        return NULL;
+    }
+
+    w = kzmalloc(sizeof(*w));
+    w->opts = opts;
+    w->timeout = -1;
+    w->pfds = kmalloc(sizeof(*w->pfds));
+    w->backend = backend;
+
+    if (w->backend->init(w)) {
+        watcher_close(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+/* there are only a few of them, stdin and some FIFOs */
+static void watcher_add_stream(struct watcher *w, struct ktail_context *ctx)
+{
+    struct ktail_context **streams;
+
+    streams = kmalloc_array(w->nr_streams + 1, sizeof(*streams));
+    if (w->nr_streams)
+        memcpy(streams, w->streams, w->nr_streams * sizeof(*streams));
+    kfree(w->streams);
+    w->streams = streams;
+    w->streams[w->nr_streams++] = ctx;
+
+    /* one more for the fd of the backend */
+    kfree(w->pfds);
+    w->pfds = kmalloc_array(w->nr_streams + 1, sizeof(*w->pfds));
+}
+
+int watcher_add(struct watcher *w, struct ktail_context *ctx)
+{
+    int ret;
+
+    /* --dir adds files while others are ready */
+    if (w->nr == w->cap) {
+        struct ktail_context **ctxs, **ready;
+
+        w->cap = w->cap ? w->cap * 2 : 16;
+        ctxs = kmalloc_array(w->cap, sizeof(*ctxs));
+        ready = kmalloc_array(w->cap, sizeof(*ready));
+        if (w->nr)
+            memcpy(ctxs, w->ctxs, w->nr * sizeof(*ctxs));
+        if (w->nr_ready)
+            memcpy(ready, w->ready, w->nr_ready * sizeof(*ready));
+        kfree(w->ctxs);
+        kfree(w->ready);
+        w->ctxs = ctxs;
+        w->ready = ready;
+    }
+
+    ret = w->backend->add(w, ctx);
+    if (ret)
+        return ret;
+
+    ctx->watcher = w;
+    ctx->watch_idx = w->nr;
+    w->ctxs[w->nr++] = ctx;
+
+    if (ctx->engine == KTAIL_ENGINE_STREAM)
+        watcher_add_stream(w, ctx);
+
+    return 0;
+}
+
+int watcher_rearm(struct watcher *w, struct ktail_context *ctx)
+{
+    return w->backend->add(w, ctx);
+}
+
+void watcher_remove(struct watcher *w, struct ktail_context *ctx)
+{
+    size_t i = ctx->watch_idx;
+
+    w->backend->remove(w, ctx);
+
+    if (ctx->ready) {
+        for (size_t j = 0; j < w->nr_ready; ++j)
+            if (w->ready[j] == ctx)
+                w->ready[j] = w->ready[--w->nr_ready];
+        ctx->ready = 0;
+    }
+
+    for (size_t j = 0; j < w->nr_streams; ++j)
+        if (w->streams[j] == ctx)
+            w->streams[j] = w->streams[--w->nr_streams];
+
+    /* swap with the last one */
+    w->ctxs[i] = w->ctxs[--w->nr];
+    w->ctxs[i]->watch_idx = i;
+    ctx->watcher = NULL;
+}
+
+int watcher_add_dir(struct watcher *w, struct watch_dir *dir)
+{
+    struct watch_dir **dirs;
+    int ret;
+
+    ret = w->backend->add_dir(w, dir);
+    if (ret)
+        return ret;
+
+    /* there are only a few of them */
+    dirs = kmalloc_array(w->nr_dirs + 1, sizeof(*dirs));
+    if (w->nr_dirs)
+        memcpy(dirs, w->dirs, w->nr_dirs * sizeof(*dirs));
+    kfree(w->dirs);
+    w->dirs = dirs;
+    w->dirs[w->nr_dirs++] = dir;
+
+    return 0;
+}
+
+int watcher_wait(struct watcher *w)
+{
+    for (size_t i = 0; i < w->nr_ready; ++i)
+        w->ready[i]->ready = 0;
+    w->nr_ready = 0;
+
+    return w->backend->wait(w);
+}
+
+int watcher_fd(const struct watcher *w)
+{
+    return w->backend->fd(w);
+}
+
+void watcher_close(struct watcher *w)
+{
+    if (!w)
+        return;
+
+    w->backend->close(w);
+    for (size_t i = 0; i < w->nr; ++i)
+        w->ctxs[i]->watcher = NULL;
+    kfree(w->ctxs);
+    kfree(w->ready);
+    kfree(w->dirs);
+    kfree(w->streams);
+    kfree(w->pfds);
+    kfree(w);
+}
+
+void watcher_ready(struct watcher *w, struct ktail_context *ctx)
+{
+    if (ctx->ready)
+        return;
+
+    ctx->ready = 1;
+    w->ready[w->nr_ready++] = ctx;
+}
+
+void watcher_dir_ready(struct watcher *w, struct watch_dir *dir,
+                       const char *name, int created)
+{
+    size_t len = name ? strlen(name) + 2 : 0;
+
+    (void)w;
+    dir->ready = 1;
+    if (!name || dir->rescan ||
+        dir->names_len + len > WATCH_DIR_MAX_NAMES) {
+        dir->rescan = 1;
+        dir->names_len = 0;
+        return;
+    }
+
+    if (dir->names_len + len > dir->names_cap) {
+        size_t cap = dir->names_cap ? dir->names_cap : 4096;
+        char *names;
+
+        while (cap < dir->names_len + len)
+            cap *= 2;
+        names = kmalloc(cap);
+        if (dir->names_len)
+            memcpy(names, dir->names, dir->names_len);
+        kfree(dir->names);
+        dir->names = names;
+        dir->names_cap = cap;
+    }
+
+    dir->names[dir->names_len] = created ? '+' : '-';
+    memcpy(dir->names + dir->names_len + 1, name, len - 1);
+    dir->names_len += len;
+}
+
+int wait_coalesce(const struct watcher *w)
+{
+    unsigned long coalesce = w->opts->coalesce;
+    struct timespec ts;
+
+    if (!coalesce)
+        return 0;
+
+    ts.tv_sec = coalesce / 1000000;
+    ts.tv_nsec = (coalesce % 1000000) * 1000;
+
+    return nanosleep(&ts, NULL) ? -EINTR : 0;
+}
+
+int watcher_poll(struct watcher *w, int fd, int timeout)
+{
+    size_t nr = 0, first = fd >= 0;
+    int ret;
+
+    if (fd >= 0)
+        w->pfds[nr++] = (struct pollfd){ .fd = fd, .events = POLLIN };
+    for (size_t i = 0; i < w->nr_streams; ++i)
+        w->pfds[nr++] = (struct pollfd){ .fd = w->streams[i]->fd,
+                                         .events = POLLIN };
+
+    STATS_INC(w->opts->stats, syscalls);
+    ret = poll(w->pfds, nr, timeout);
+    if (ret < 0) {
+        if (errno == EINTR)
+            return 0;
+        print_err_errno("poll() failed");
+        return -EIO;
+    }
+
+    /* the end of a pipe is reported as POLLHUP */
+    for (size_t i = first; ret && i < nr; ++i)
+        if (w->pfds[i].revents)
+            watcher_ready(w, w->streams[i - first]);
+
+    return ret;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _WAIT_H_
+#define _WAIT_H_
+
+#include <stddef.h>
+#include <time.h>
+
+#include "ktail_config.h"
+
+struct ktail_context;
+struct ktail_options;
+struct watcher;
+struct pollfd;
+
+/* returned by wait() if a termination signal has been received */
+#define WAIT_STOP 1
+
+/* beyond this, names are dropped and the directory is read again */
+#define WATCH_DIR_MAX_NAMES (1 << 20)
+
+/*
+ * Directory whose entries are followed. Backends, which know the names, queue
+ * them; the others request a rescan.
+ */
+struct watch_dir {
+    const char *path;
+    int wd;                     /* inotify watch or kqueue fd */
+    struct timespec mtime;      /* seen by the poll backend */
+    int ready;
+    int rescan;
+    /* "+name\0" for created and "-name\0" for removed entries */
+    char *names;
+    size_t names_len, names_cap;
+};
+
+/*
+ * Interface of the mechanisms waiting for followed files to change. All files
+ * share one backend instance, whose state is stored in w->priv.
+ */
+struct wait_backend {
+    const char *name;
+    int (*init)(struct watcher *w);
+    /* starts watching the file of ctx, also called after it was reopened */
+    int (*add)(struct watcher *w, struct ktail_context *ctx);
+    void (*remove)(struct watcher *w, struct ktail_context *ctx);
+    /* starts watching the entries of a directory */
+    int (*add_dir)(struct watcher *w, struct watch_dir *dir);
+    /* blocks until files changed or for w->timeout, see watcher_ready() */
+    int (*wait)(struct watcher *w);
+    void (*close)(struct watcher *w);
+    /* fd which becomes readable on events, or -1 */
+    int (*fd)(const struct watcher *w);
+};
+
+struct watcher {
+    const struct wait_backend *backend;
+    const struct ktail_options *opts;
+    void *priv;
+    /* all watched files */
+    struct ktail_context **ctxs;
+    size_t nr, cap;
+    /* files changed since the last wait */
+    struct ktail_context **ready;
+    size_t nr_ready;
+    /* watched directories, they're reset by their owner */
+    struct watch_dir **dirs;
+    size_t nr_dirs;
+    /* pipes have no size to watch, they're polled, see watcher_poll() */
+    struct ktail_context **streams;
+    size_t nr_streams;
+    struct pollfd *pfds;
+    /* msec a wait blocks at most, -1 for no limit */
+    int timeout;
+};
+
+/* available backends, the first one is the default */
+extern const struct wait_backend *const wait_backends[];
+
+const struct wait_backend *wait_backend_find(const char *name);
+
+/* backend, coalescing and polling are taken from opts */
+struct watcher *watcher_init(const struct ktail_options *opts);
+int watcher_add(struct watcher *w, struct ktail_context *ctx);
+int watcher_rearm(struct watcher *w, struct ktail_context *ctx);
+void watcher_remove(struct watcher *w, struct ktail_context *ctx);
+int watcher_add_dir(struct watcher *w, struct watch_dir *dir);
+/* blocks until w->ready holds the changed files or WAIT_STOP */
+int watcher_wait(struct watcher *w);
+int watcher_fd(const struct watcher *w);
+void watcher_close(struct watcher *w);
+
+/* helpers for backends */
+void watcher_ready(struct watcher *w, struct ktail_context *ctx);
+/* an entry has been created or removed, a NULL name requests a rescan */
+void watcher_dir_ready(struct watcher *w, struct watch_dir *dir,
+                       const char *name, int created);
+/* gives a write burst some time to complete, returns -EINTR on signals */
+int wait_coalesce(const struct watcher *w);
+/*
+ * Polls fd (-1 for none) and the pipes for timeout msec, the pipes with data
+ * become ready. Returns > 0 if any of them is readable, 0 on timeouts and
+ * signals.
+ */
+int watcher_poll(struct watcher *w, int fd, int timeout);
+
+#ifdef HAVE_INOTIFY
+/* inotify helpers shared by the inotify and epoll backend */
+struct inotify_watch {
+    int fd;
+    /* watch descriptor -> context or directory */
+    struct ktail_context **ctxs;
+    size_t cap;
+    struct watch_dir **dirs;
+    size_t dirs_cap;
+    /* -F: files by parent watch and name, kept at most half full */
+    struct ktail_context **names;
+    size_t names_cap, nr_names;
+};
+
+int inotify_watch_init(struct inotify_watch *iw);
+int inotify_watch_add(struct inotify_watch *iw, struct ktail_context *ctx);
+void inotify_watch_remove(struct inotify_watch *iw, struct ktail_context *ctx);
+int inotify_watch_add_dir(struct inotify_watch *iw, struct watch_dir *dir);
+/* consumes all pending events, returns the number of modified files */
+int inotify_watch_events(struct inotify_watch *iw, struct watcher *w);
+void inotify_watch_close(struct inotify_watch *iw);
+#endif
+
+#endif /* _WAIT_H_ */
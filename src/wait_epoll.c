@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "wait.h"
+
+#include "ktail.h"
+#include "stats.h"
+#include "utils.h"
+
+/*
+ * Event loop multiplexing the inotify fd, a timerfd, which implements the
+ * coalescing window, and the fds of pipes. With opts->signals, SIGINT/SIGTERM
+ * are received via a signalfd as well. Embedders keep their signals.
+ */
+struct epoll_wait_data {
+    struct inotify_watch iw;
+    int epfd;
+    int sfd;
+    int tfd;
+    sigset_t old_mask;
+    int masked;
+};
+
+#define NR_EVENTS 16
+
+/* the data of an event points to the fd in epoll_wait_data or to a pipe */
+static int epoll_add(int epfd, int fd, void *ptr)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ptr };
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        print_err_errno("epoll_ctl() failed");
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static int wait_epoll_init(struct watcher *w)
+{
+    struct epoll_wait_data *data = kzmalloc(sizeof(*data));
+    sigset_t mask;
+    int ret;
+
+    data->iw.fd = data->epfd = data->sfd = data->tfd = -1;
+    w->priv = data;
+
+    ret = inotify_watch_init(&data->iw);
+    if (ret)
+        return ret;
+
+    data->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (data->tfd < 0) {
+        print_err_errno("timerfd_create() failed");
+        return -ENOMEM;
+    }
+
+    data->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (data->epfd < 0) {
+        print_err_errno("epoll_create1() failed");
+        return -ENOMEM;
+    }
+
+    if (epoll_add(data->epfd, data->iw.fd, &data->iw.fd) ||
+        epoll_add(data->epfd, data->tfd, &data->tfd))
+        return -ENOMEM;
+
+    if (!w->opts->signals)
+        return 0;
+
+    /* termination signals are received via the signalfd */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    if (sigprocmask(SIG_BLOCK, &mask, &data->old_mask)) {
+        print_err_errno("sigprocmask() failed");
+        return -EINVAL;
+    }
+    data->masked = 1;
+
+    data->sfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (data->sfd < 0) {
+        print_err_errno("signalfd() failed");
+        return -ENOMEM;
+    }
+
+    return epoll_add(data->epfd, data->sfd, &data->sfd);
+}
+
+static int wait_epoll_add(struct watcher *w, struct ktail_context *ctx)
+{
+    struct epoll_wait_data *data = w->priv;
+
+    /* the end of a pipe is reported as EPOLLHUP */
+    if (ctx->engine == KTAIL_ENGINE_STREAM)
+        return epoll_add(data->epfd, ctx->fd, ctx);
+
+    return inotify_watch_add(&data->iw, ctx);
+}
+
+static void wait_epoll_remove(struct watcher *w, struct ktail_context *ctx)
+{
+    struct epoll_wait_data *data = w->priv;
+
+    if (ctx->engine == KTAIL_ENGINE_STREAM)
+        epoll_ctl(data->epfd, EPOLL_CTL_DEL, ctx->fd, NULL);
+    else
+        inotify_watch_remove(&data->iw, ctx);
+}
+
+static int wait_epoll_add_dir(struct watcher *w, struct watch_dir *dir)
+{
+    struct epoll_wait_data *data = w->priv;
+
+    return inotify_watch_add_dir(&data->iw, dir);
+}
+
+static int wait_epoll_arm_timer(struct epoll_wait_data *data,
+                                unsigned long coalesce)
+{
+    struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+
+    its.it_value.tv_sec = coalesce / 1000000;
+    its.it_value.tv_nsec = (coalesce % 1000000) * 1000;
+
+    if (timerfd_settime(data->tfd, 0, &its, NULL)) {
+        print_err_errno("timerfd_settime() failed");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int wait_epoll_wait(struct watcher *w)
+{
+    struct epoll_wait_data *data = w->priv;
+    int modified = 0;
+
+    while (42) {
+        struct epoll_event events[NR_EVENTS];
+        int nev, ret, expired = 0, streams = 0;
+
+        nev = epoll_wait(data->epfd, events, NR_EVENTS, w->timeout);
+        STATS_INC(w->opts->stats, syscalls);
+        if (nev < 0) {
+            /* other signals, e.g. SIGUSR1 of --stats, are handled by the caller */
+            if (errno == EINTR)
+                return 0;
+            print_err_errno("epoll_wait() failed");
+            return -EIO;
+        }
+        if (!nev)
+            return 0;
+
+        for (int i = 0; i < nev; ++i) {
+            void *ptr = events[i].data.ptr;
+
+            if (ptr == &data->sfd) {
+                struct signalfd_siginfo si;
+
+                while (read(data->sfd, &si, sizeof(si)) > 0)
+                    ;
+                return WAIT_STOP;
+            }
+
+            if (ptr == &data->tfd) {
+                uint64_t expirations;
+
+                if (read(data->tfd, &expirations, sizeof(expirations)) > 0)
+                    expired = 1;
+                continue;
+            }
+
+            /* a pipe stays readable, it's not worth coalescing */
+            if (ptr != &data->iw.fd) {
+                watcher_ready(w, ptr);
+                streams = 1;
+                continue;
+            }
+
+            ret = inotify_watch_events(&data->iw, w);
+            if (ret < 0)
+                return ret;
+            if (ret && !modified) {
+                modified = 1;
+                if (!w->opts->coalesce)
+                    return 0;
+                ret = wait_epoll_arm_timer(data, w->opts->coalesce);
+                if (ret)
+                    return ret;
+            }
+        }
+
+        if (streams || (modified && expired))
+            return 0;
+    }
+}
+
+static void wait_epoll_close(struct watcher *w)
+{
+    struct epoll_wait_data *data = w->priv;
+
+    if (!data)
+        return;
+
+    if (data->epfd >= 0)
+        close(data->epfd);
+    if (data->tfd >= 0)
+        close(data->tfd);
+    if (data->sfd >= 0)
+        close(data->sfd);
+    if (data->masked)
+        sigprocmask(SIG_SETMASK, &data->old_mask, NULL);
+    inotify_watch_close(&data->iw);
+
+    kfree(w->priv);
+}
+
+static int wait_epoll_fd(const struct watcher *w)
+{
+    const struct epoll_wait_data *data = w->priv;
+
+    return data->epfd;
+}
+
+const struct wait_backend wait_epoll = {
+    .name     = "epoll",
+    .init     = wait_epoll_init,
+    .add      = wait_epoll_add,
+    .remove   = wait_epoll_remove,
+    .add_dir  = wait_epoll_add_dir,
+    .wait     = wait_epoll_wait,
+    .close    = wait_epoll_close,
+    .fd       = wait_epoll_fd,
+};
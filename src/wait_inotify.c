@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/inotify.h>
+
+#include "wait.h"
+
+#include "ktail.h"
+#include "stats.h"
+#include "utils.h"
+
+#define BUF_SIZE (64 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+/* -F also watches for the file being moved, deleted or recreated */
+#define FILE_EVENTS (IN_MODIFY)
+#define NAME_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+#define DIR_EVENTS  (IN_CREATE | IN_MOVED_TO | IN_ONLYDIR)
+/* --dir also drops the files, which are deleted or moved away */
+#define ENTRY_EVENTS (DIR_EVENTS | IN_DELETE | IN_MOVED_FROM)
+
+int inotify_watch_init(struct inotify_watch *iw)
+{
+    iw->ctxs = NULL;
+    iw->cap = 0;
+    iw->dirs = NULL;
+    iw->dirs_cap = 0;
+    iw->names = NULL;
+    iw->names_cap = 0;
+    iw->nr_names = 0;
+    iw->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (iw->fd < 0) {
+        print_err_errno("inotify_init1() failed");
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/* watch descriptors are small integers, so they index arrays of pointers */
+static void *inotify_watch_grow(void *array, size_t *cap, int wd)
+{
+    size_t new_cap = *cap ? *cap : 64;
+    void **new;
+
+    if ((size_t)wd < *cap)
+        return array;
+
+    while (new_cap <= (size_t)wd)
+        new_cap *= 2;
+    new = kzmalloc_array(new_cap, sizeof(*new));
+    if (*cap)
+        memcpy(new, array, *cap * sizeof(*new));
+    kfree(array);
+    *cap = new_cap;
+
+    return new;
+}
+
+static void inotify_watch_map(struct inotify_watch *iw, int wd,
+                              struct ktail_context *ctx)
+{
+    iw->ctxs = inotify_watch_grow(iw->ctxs, &iw->cap, wd);
+    iw->ctxs[wd] = ctx;
+}
+
+static size_t inotify_watch_hash(int wd, const char *name)
+{
+    return path_hash(name) ^ (size_t)wd * 0x9e3779b9u;
+}
+
+/* an empty slot, names may show up twice if a file is given twice */
+static void inotify_names_put(struct inotify_watch *iw,
+                              struct ktail_context *ctx)
+{
+    size_t mask = iw->names_cap - 1, i = ctx->name_hash & mask;
+
+    while (iw->names[i])
+        i = (i + 1) & mask;
+    iw->names[i] = ctx;
+}
+
+static void inotify_names_insert(struct inotify_watch *iw,
+                                 struct ktail_context *ctx)
+{
+    if ((iw->nr_names + 1) * 2 > iw->names_cap) {
+        struct ktail_context **names = iw->names;
+        size_t cap = iw->names_cap;
+
+        iw->names_cap = cap ? cap * 2 : 64;
+        iw->names = kzmalloc_array(iw->names_cap, sizeof(*iw->names));
+        for (size_t i = 0; i < cap; ++i)
+            if (names[i])
+                inotify_names_put(iw, names[i]);
+        kfree(names);
+    }
+
+    inotify_names_put(iw, ctx);
+    iw->nr_names++;
+}
+
+/* the following entries are shifted back into the hole, see dir_unlink() */
+static void inotify_names_remove(struct inotify_watch *iw,
+                                 struct ktail_context *ctx)
+{
+    size_t mask = iw->names_cap - 1, i = ctx->name_hash & mask, j;
+
+    while (iw->names[i] != ctx) {
+        if (!iw->names[i])
+            return;
+        i = (i + 1) & mask;
+    }
+
+    iw->names[i] = NULL;
+    iw->nr_names--;
+
+    for (j = (i + 1) & mask; iw->names[j]; j = (j + 1) & mask) {
+        size_t home = iw->names[j]->name_hash & mask;
+
+        /* entries whose home is cyclically within (i, j] stay */
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        iw->names[i] = iw->names[j];
+        iw->names[j] = NULL;
+        i = j;
+    }
+}
+
+/* files in the same directory share its watch */
+static int inotify_watch_dir(struct inotify_watch *iw, struct ktail_context *ctx)
+{
+    char dir[PATH_MAX];
+    int wd;
+
+    if (path_dirname(ctx->file, dir, sizeof(dir))) {
+        print_err("Path '%s' is too long", ctx->file);
+        return -ENAMETOOLONG;
+    }
+
+    wd = inotify_add_watch(iw->fd, dir, DIR_EVENTS);
+    if (wd < 0) {
+        print_err_errno("inotify_add_watch() failed for '%s'", dir);
+        return -ENOMEM;
+    }
+    ctx->dir_watch = wd;
+    ctx->name_hash = inotify_watch_hash(wd, path_basename(ctx->file));
+    inotify_names_insert(iw, ctx);
+
+    return 0;
+}
+
+static void inotify_watch_remove_file(struct inotify_watch *iw,
+                                      struct ktail_context *ctx)
+{
+    if (ctx->wd < 0)
+        return;
+
+    /* fails if the watch vanished together with its inode, that's fine */
+    inotify_rm_watch(iw->fd, ctx->wd);
+    if ((size_t)ctx->wd < iw->cap && iw->ctxs[ctx->wd] == ctx)
+        iw->ctxs[ctx->wd] = NULL;
+    ctx->wd = -1;
+}
+
+int inotify_watch_add(struct inotify_watch *iw, struct ktail_context *ctx)
+{
+    /* a file on standard input is found via the fd */
+    const char *path = ktail_is_stdin(ctx->file) ? "/dev/stdin" : ctx->file;
+    int wd;
+
+    /* pipes are polled instead, see watcher_poll() */
+    if (ctx->engine == KTAIL_ENGINE_STREAM)
+        return 0;
+
+    inotify_watch_remove_file(iw, ctx);
+
+    wd = inotify_add_watch(iw->fd, path,
+                           ctx->opts->follow_name ? NAME_EVENTS : FILE_EVENTS);
+    if (wd < 0) {
+        print_err_errno("inotify_add_watch() failed for '%s'", ctx->file);
+        return -ENOMEM;
+    }
+    inotify_watch_map(iw, wd, ctx);
+    ctx->wd = wd;
+
+    if (ctx->opts->follow_name && ctx->dir_watch < 0)
+        return inotify_watch_dir(iw, ctx);
+
+    return 0;
+}
+
+void inotify_watch_remove(struct inotify_watch *iw, struct ktail_context *ctx)
+{
+    /* the directory watch may be shared, it's dropped with the inotify fd */
+    inotify_watch_remove_file(iw, ctx);
+    if (ctx->dir_watch >= 0)
+        inotify_names_remove(iw, ctx);
+    ctx->dir_watch = -1;
+}
+
+int inotify_watch_add_dir(struct inotify_watch *iw, struct watch_dir *dir)
+{
+    int wd = inotify_add_watch(iw->fd, dir->path, ENTRY_EVENTS);
+
+    if (wd < 0) {
+        print_err_errno("inotify_add_watch() failed for '%s'", dir->path);
+        return -ENOMEM;
+    }
+
+    iw->dirs = inotify_watch_grow(iw->dirs, &iw->dirs_cap, wd);
+    iw->dirs[wd] = dir;
+    dir->wd = wd;
+
+    return 0;
+}
+
+/* a file has been created in a watched directory, it's looked up by name */
+static int inotify_watch_created(struct inotify_watch *iw, struct watcher *w,
+                                 int wd, const char *name)
+{
+    size_t hash = inotify_watch_hash(wd, name), mask = iw->names_cap - 1;
+    int created = 0;
+
+    if (!iw->nr_names)
+        return 0;
+
+    for (size_t i = hash & mask; iw->names[i]; i = (i + 1) & mask) {
+        struct ktail_context *ctx = iw->names[i];
+
+        if (ctx->name_hash == hash && ctx->dir_watch == wd &&
+            !strcmp(path_basename(ctx->file), name)) {
+            watcher_ready(w, ctx);
+            created++;
+        }
+    }
+
+    return created;
+}
+
+/* -F files whose file watch is gone are only found by name */
+static void inotify_watch_overflow(struct inotify_watch *iw, struct watcher *w)
+{
+    for (size_t i = 0; i < iw->cap; ++i)
+        if (iw->ctxs[i])
+            watcher_ready(w, iw->ctxs[i]);
+    for (size_t i = 0; i < iw->names_cap; ++i)
+        if (iw->names[i])
+            watcher_ready(w, iw->names[i]);
+    for (size_t i = 0; i < w->nr_dirs; ++i)
+        watcher_dir_ready(w, w->dirs[i], NULL, 0);
+}
+
+int inotify_watch_events(struct inotify_watch *iw, struct watcher *w)
+{
+    char buf[BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int modified = 0;
+
+    /* each read collects all events queued so far */
+    while (42) {
+        ssize_t rc = read(iw->fd, buf, BUF_SIZE);
+        const char *p = buf;
+
+        STATS_INC(w->opts->stats, syscalls);
+        if (rc < 0) {
+            if (errno == EAGAIN)
+                break;
+            if (errno == EINTR)
+                continue;
+            print_err_errno("Failed to read from inotify fd");
+            return -EIO;
+        }
+
+        while (p < buf + rc) {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            struct ktail_context *ctx = NULL;
+
+            p += sizeof(*event) + event->len;
+
+            /*
+             * The queue overflowed and events are lost, so every file is read
+             * at its offset and the directories are read again.
+             */
+            if (event->mask & IN_Q_OVERFLOW) {
+                inotify_watch_overflow(iw, w);
+                modified++;
+                continue;
+            }
+
+            /* entries of a --dir directory, subdirectories are skipped */
+            if (event->len && event->wd >= 0 &&
+                (size_t)event->wd < iw->dirs_cap && iw->dirs[event->wd]) {
+                if (event->mask & IN_ISDIR)
+                    continue;
+                watcher_dir_ready(w, iw->dirs[event->wd], event->name,
+                                  event->mask & (IN_CREATE | IN_MOVED_TO));
+                modified++;
+                continue;
+            }
+
+            /* events of the parent directory carry a name */
+            if (event->len) {
+                modified += inotify_watch_created(iw, w, event->wd,
+                                                  event->name);
+                continue;
+            }
+
+            if (event->wd >= 0 && (size_t)event->wd < iw->cap)
+                ctx = iw->ctxs[event->wd];
+            if (!ctx)
+                continue;
+
+            /* the watch is gone, e.g. the file has been deleted */
+            if (event->mask & IN_IGNORED) {
+                iw->ctxs[event->wd] = NULL;
+                ctx->wd = -1;
+                continue;
+            }
+
+            if (event->mask & NAME_EVENTS) {
+                watcher_ready(w, ctx);
+                modified++;
+            }
+        }
+    }
+
+    return modified;
+}
+
+void inotify_watch_close(struct inotify_watch *iw)
+{
+    if (iw->fd >= 0)
+        close(iw->fd);
+    kfree(iw->ctxs);
+    kfree(iw->dirs);
+    kfree(iw->names);
+}
+
+static int wait_inotify_init(struct watcher *w)
+{
+    struct inotify_watch *iw = kzmalloc(sizeof(*iw));
+
+    iw->fd = -1;
+    w->priv = iw;
+
+    return inotify_watch_init(iw);
+}
+
+static int wait_inotify_add(struct watcher *w, struct ktail_context *ctx)
+{
+    return inotify_watch_add(w->priv, ctx);
+}
+
+static void wait_inotify_remove(struct watcher *w, struct ktail_context *ctx)
+{
+    inotify_watch_remove(w->priv, ctx);
+}
+
+static int wait_inotify_add_dir(struct watcher *w, struct watch_dir *dir)
+{
+    return inotify_watch_add_dir(w->priv, dir);
+}
+
+static int wait_inotify_wait(struct watcher *w)
+{
+    struct inotify_watch *iw = w->priv;
+    int ret;
+
+    while (42) {
+        ret = watcher_poll(w, iw->fd, w->timeout);
+        if (ret <= 0)
+            return ret;
+
+        ret = inotify_watch_events(iw, w);
+        if (ret < 0)
+            return ret;
+        if (ret || w->nr_ready)
+            break;
+    }
+
+    if (wait_coalesce(w))
+        return 0;
+
+    /* files modified during the burst are reported as well */
+    ret = inotify_watch_events(iw, w);
+
+    return ret < 0 ? ret : 0;
+}
+
+static void wait_inotify_close(struct watcher *w)
+{
+    struct inotify_watch *iw = w->priv;
+
+    if (!iw)
+        return;
+
+    inotify_watch_close(iw);
+    kfree(w->priv);
+}
+
+static int wait_inotify_fd(const struct watcher *w)
+{
+    const struct inotify_watch *iw = w->priv;
+
+    return iw->fd;
+}
+
+const struct wait_backend wait_inotify = {
+    .name     = "inotify",
+    .init     = wait_inotify_init,
+    .add      = wait_inotify_add,
+    .remove   = wait_inotify_remove,
+    .add_dir  = wait_inotify_add_dir,
+    .wait     = wait_inotify_wait,
+    .close    = wait_inotify_close,
+    .fd       = wait_inotify_fd,
+};
@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/event.h>
+
+#include "wait.h"
+
+#include "ktail.h"
+#include "stats.h"
+#include "utils.h"
+
+#define NR_EVENTS 64
+
+/* -F also watches for the file being renamed or deleted */
+#define FILE_EVENTS (NOTE_EXTEND | NOTE_WRITE)
+#define NAME_EVENTS (FILE_EVENTS | NOTE_RENAME | NOTE_DELETE | NOTE_ATTRIB)
+
+static int wait_kqueue_init(struct watcher *w)
+{
+    int *kq = kzmalloc(sizeof(*kq));
+
+    w->priv = kq;
+
+    *kq = kqueue();
+    if (*kq < 0) {
+        print_err_errno("kqueue() failed");
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/* a write to the parent directory means an entry has been created */
+static int wait_kqueue_watch_parent(int kq, struct ktail_context *ctx)
+{
+    char dir[PATH_MAX];
+    struct kevent change;
+
+    if (path_dirname(ctx->file, dir, sizeof(dir))) {
+        print_err("Path '%s' is too long", ctx->file);
+        return -ENAMETOOLONG;
+    }
+
+    ctx->dir_watch = open(dir, O_RDONLY | O_CLOEXEC);
+    if (ctx->dir_watch < 0) {
+        print_err_errno("Failed to open directory '%s'", dir);
+        return -EIO;
+    }
+
+    EV_SET(&change, ctx->dir_watch, EVFILT_VNODE,
+           EV_ADD | EV_ENABLE | EV_CLEAR,
+           NOTE_WRITE,
+           0, ctx);
+
+    if (kevent(kq, &change, 1, NULL, 0, NULL) < 0) {
+        print_err_errno("kevent() failed for '%s'", dir);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/* pipes have no size to watch, their data is */
+static int wait_kqueue_add_stream(int kq, struct ktail_context *ctx)
+{
+    struct kevent change;
+
+    EV_SET(&change, ctx->fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, ctx);
+
+    if (kevent(kq, &change, 1, NULL, 0, NULL) < 0) {
+        print_err_errno("kevent() failed for '%s'", ctx->file);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static int wait_kqueue_add(struct watcher *w, struct ktail_context *ctx)
+{
+    int *kq = w->priv;
+    struct kevent change;
+
+    if (ctx->engine == KTAIL_ENGINE_STREAM)
+        return wait_kqueue_add_stream(*kq, ctx);
+
+    /* the filter of an old fd vanished when it was closed */
+    EV_SET(&change, ctx->fd, EVFILT_VNODE,
+           EV_ADD | EV_ENABLE | EV_CLEAR,
+           ctx->opts->follow_name ? NAME_EVENTS : FILE_EVENTS,
+           0, ctx);
+
+    if (kevent(*kq, &change, 1, NULL, 0, NULL) < 0) {
+        print_err_errno("kevent() failed for '%s'", ctx->file);
+        return -ENOMEM;
+    }
+
+    if (ctx->opts->follow_name && ctx->dir_watch < 0)
+        return wait_kqueue_watch_parent(*kq, ctx);
+
+    return 0;
+}
+
+static void wait_kqueue_remove(struct watcher *w, struct ktail_context *ctx)
+{
+    int *kq = w->priv;
+    struct kevent change;
+
+    EV_SET(&change, ctx->fd, ctx->engine == KTAIL_ENGINE_STREAM ?
+           EVFILT_READ : EVFILT_VNODE, EV_DELETE, 0, 0, NULL);
+    kevent(*kq, &change, 1, NULL, 0, NULL);
+
+    /* closing the directory drops its filter as well */
+    if (ctx->dir_watch >= 0)
+        close(ctx->dir_watch);
+    ctx->dir_watch = -1;
+}
+
+/* entries of a --dir directory, any write to it triggers a rescan */
+static int wait_kqueue_add_dir(struct watcher *w, struct watch_dir *dir)
+{
+    int *kq = w->priv;
+    struct kevent change;
+
+    dir->wd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir->wd < 0) {
+        print_err_errno("Failed to open directory '%s'", dir->path);
+        return -EIO;
+    }
+
+    EV_SET(&change, dir->wd, EVFILT_VNODE, EV_ADD | EV_ENABLE | EV_CLEAR,
+           NOTE_WRITE, 0, dir);
+
+    if (kevent(*kq, &change, 1, NULL, 0, NULL) < 0) {
+        print_err_errno("kevent() failed for '%s'", dir->path);
+        close(dir->wd);
+        dir->wd = -1;
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/* the udata of an event is a directory or a context */
+static void wait_kqueue_event(struct watcher *w, const struct kevent *event)
+{
+    /* data or the end of a pipe */
+    if (event->filter == EVFILT_READ) {
+        watcher_ready(w, event->udata);
+        return;
+    }
+
+    for (size_t i = 0; i < w->nr_dirs; ++i) {
+        if (event->udata == (void *)w->dirs[i]) {
+            watcher_dir_ready(w, w->dirs[i], NULL, 0);
+            return;
+        }
+    }
+
+    if (event->fflags & NAME_EVENTS)
+        watcher_ready(w, event->udata);
+}
+
+static int wait_kqueue_wait(struct watcher *w)
+{
+    int *kq = w->priv;
+    struct kevent events[NR_EVENTS];
+    struct timespec zero = { 0, 0 }, timeout;
+    int nev, modified = 0;
+
+    timeout.tv_sec = w->timeout / 1000;
+    timeout.tv_nsec = (w->timeout % 1000) * 1000000L;
+
+    /* zZz */
+    while (!modified) {
+        nev = kevent(*kq, NULL, 0, events, NR_EVENTS,
+                     w->timeout < 0 ? NULL : &timeout);
+        STATS_INC(w->opts->stats, syscalls);
+        if (nev < 0) {
+            if (errno == EINTR)
+                return 0;
+            print_err_errno("kevent() failed");
+            return -ENOMEM;
+        }
+        if (!nev)
+            return 0;
+
+        for (int i = 0; i < nev; ++i) {
+            wait_kqueue_event(w, &events[i]);
+            modified = 1;
+        }
+    }
+
+    if (wait_coalesce(w))
+        return 0;
+
+    /* files modified during the burst are reported as well */
+    do {
+        nev = kevent(*kq, NULL, 0, events, NR_EVENTS, &zero);
+        for (int i = 0; i < nev; ++i)
+            wait_kqueue_event(w, &events[i]);
+    } while (nev == NR_EVENTS);
+
+    return 0;
+}
+
+static void wait_kqueue_close(struct watcher *w)
+{
+    int *kq = w->priv;
+
+    if (!kq)
+        return;
+
+    for (size_t i = 0; i < w->nr; ++i) {
+        if (w->ctxs[i]->dir_watch >= 0)
+            close(w->ctxs[i]->dir_watch);
+        w->ctxs[i]->dir_watch = -1;
+    }
+    for (size_t i = 0; i < w->nr_dirs; ++i)
+        if (w->dirs[i]->wd >= 0)
+            close(w->dirs[i]->wd);
+    if (*kq >= 0)
+        close(*kq);
+    kfree(w->priv);
+}
+
+static int wait_kqueue_fd(const struct watcher *w)
+{
+    const int *kq = w->priv;
+
+    return *kq;
+}
+
+const struct wait_backend wait_kqueue = {
+    .name     = "kqueue",
+    .init     = wait_kqueue_init,
+    .add      = wait_kqueue_add,
+    .remove   = wait_kqueue_remove,
+    .add_dir  = wait_kqueue_add_dir,
+    .wait     = wait_kqueue_wait,
+    .close    = wait_kqueue_close,
+    .fd       = wait_kqueue_fd,
+};
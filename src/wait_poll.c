@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2016 Kurt Kanzenbach <kurt@kmk-computers.de>
+ *
+ * This file is part of Ktail.
+ *
+ * Ktail is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Ktail is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Ktail.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "wait.h"
+
+#include "ktail.h"
+#include "stats.h"
+#include "utils.h"
+
+/*
+ * Adaptive polling via fstat() on the opened fds, which works where inotify
+ * misses changes (e.g. NFS or FUSE). The interval doubles while the files are
+ * idle and snaps back to the minimum once one of them grows.
+ */
+struct poll_wait_data {
+    unsigned long interval;     /* usec */
+};
+
+static int wait_poll_init(struct watcher *w)
+{
+    struct poll_wait_data *data = kzmalloc(sizeof(*data));
+
+    data->interval = w->opts->poll_min;
+    w->priv = data;
+
+    return 0;
+}
+
+static int wait_poll_add(struct watcher *w, struct ktail_context *ctx)
+{
+    struct poll_wait_data *data = w->priv;
+
+    /* a reopened file is looked at in the next round */
+    ctx->poll_nlink = 0;
+    data->interval = w->opts->poll_min;
+
+    return 0;
+}
+
+static void wait_poll_remove(struct watcher *w, struct ktail_context *ctx)
+{
+    (void)w;
+    (void)ctx;
+}
+
+/*
+ * A deleted file stays deleted, so a change is only reported once, until the
+ * size or the links change again. resized is set if there's data to read.
+ */
+static int wait_poll_changed(struct ktail_context *ctx, int check_path,
+                             int *resized)
+{
+    struct stats *stats = ctx->opts->stats;
+    struct stat buf;
+
+    STATS_INC(stats, syscalls);
+    if (fstat(ctx->fd, &buf))
+        return 1;
+
+    /* deleted or changed in size */
+    if ((size_t)buf.st_size != ctx->poll_size ||
+        buf.st_nlink != ctx->poll_nlink) {
+        ctx->poll_size = buf.st_size;
+        ctx->poll_nlink = buf.st_nlink;
+        if ((size_t)buf.st_size != ctx->bytes) {
+            *resized = 1;
+            return 1;
+        }
+        if (!buf.st_nlink)
+            return 1;
+    }
+
+    /*
+     * Renames are only noticed via the path, which is looked up rarely unless
+     * -F is given.
+     */
+    if (check_path)
+        STATS_INC(stats, syscalls);
+    if (check_path && !stat(ctx->file, &buf) &&
+        (buf.st_ino != ctx->ino || buf.st_dev != ctx->dev))
+        return 1;
+
+    return 0;
+}
+
+static int wait_poll_add_dir(struct watcher *w, struct watch_dir *dir)
+{
+    struct stat buf;
+
+    (void)w;
+    if (stat(dir->path, &buf)) {
+        print_err_errno("stat() failed for '%s'", dir->path);
+        return -EIO;
+    }
+    dir->mtime = buf.st_mtim;
+
+    return 0;
+}
+
+/* entries are created, removed or renamed */
+static int wait_poll_dir_changed(struct watcher *w, struct watch_dir *dir)
+{
+    struct stat buf;
+
+    STATS_INC(w->opts->stats, syscalls);
+    if (stat(dir->path, &buf) ||
+        (buf.st_mtim.tv_sec == dir->mtime.tv_sec &&
+         buf.st_mtim.tv_nsec == dir->mtime.tv_nsec))
+        return 0;
+    dir->mtime = buf.st_mtim;
+
+    return 1;
+}
+
+/* one polling round, the caller checks for termination in between */
+static int wait_poll_wait(struct watcher *w)
+{
+    const struct ktail_options *opts = w->opts;
+    struct poll_wait_data *data = w->priv;
+    int check_path = opts->follow_name || data->interval >= opts->poll_max;
+    unsigned long interval;
+    struct timespec ts;
+    int ret, resized = 0, dirs = 0;
+
+    /* pipes have no size, they wake up the sleep below instead */
+    for (size_t i = 0; i < w->nr; ++i)
+        if (w->ctxs[i]->engine != KTAIL_ENGINE_STREAM &&
+            wait_poll_changed(w->ctxs[i], check_path, &resized))
+            watcher_ready(w, w->ctxs[i]);
+
+    for (size_t i = 0; i < w->nr_dirs; ++i) {
+        if (wait_poll_dir_changed(w, w->dirs[i])) {
+            watcher_dir_ready(w, w->dirs[i], NULL, 0);
+            dirs = 1;
+        }
+    }
+
+    /* renames and deletions bring no data, they're reported after the sleep */
+    if (resized || dirs) {
+        data->interval = opts->poll_min;
+        return 0;
+    }
+
+    /* zZz */
+    interval = data->interval;
+    if (w->timeout >= 0 && interval > w->timeout * 1000UL)
+        interval = w->timeout * 1000UL;
+    if (w->nr_streams) {
+        size_t nr_ready = w->nr_ready;
+
+        ret = watcher_poll(w, -1, (interval + 999) / 1000);
+        if (ret < 0)
+            return ret;
+        if (w->nr_ready > nr_ready) {
+            data->interval = opts->poll_min;
+            return 0;
+        }
+    } else {
+        ts.tv_sec = interval / 1000000;
+        ts.tv_nsec = (interval % 1000000) * 1000;
+        STATS_INC(opts->stats, syscalls);
+        if (nanosleep(&ts, NULL) && errno != EINTR) {
+            print_err_errno("nanosleep() failed");
+            return -EINTR;
+        }
+    }
+
+    data->interval *= 2;
+    if (data->interval > opts->poll_max)
+        data->interval = opts->poll_max;
+
+    return 0;
+}
+
+static void wait_poll_close(struct watcher *w)
+{
+    kfree(w->priv);
+}
+
+static int wait_poll_fd(const struct watcher *w)
+{
+    (void)w;
+
+    return -1;
+}
+
+const struct wait_backend wait_poll = {
+    .name     = "poll",
+    .init     = wait_poll_init,
+    .add      = wait_poll_add,
+    .remove   = wait_poll_remove,
+    .add_dir  = wait_poll_add_dir,
+    .wait     = wait_poll_wait,
+    .close    = wait_poll_close,
+    .fd       = wait_poll_fd,
+};